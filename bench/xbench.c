@@ -0,0 +1,311 @@
+// Distributed under the MIT License
+
+// xbench provides the programs driven by bench/run: a generator of synthetic
+// input, a consumer measuring the latency of records, and a clock.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+// Distribution of line lengths.
+enum
+{
+    dist_fixed,     // always mean
+    dist_uniform,   // between min and max
+    dist_exp,       // exponential around mean, at least min
+};
+
+// generator is the configuration of the generator.
+struct generator
+{
+    uintmax_t total;    // bytes to write
+    int dist;
+    size_t min;
+    size_t max;
+    size_t mean;
+    double rate;        // lines per second, or zero for unlimited
+    size_t burst;       // lines written at once
+    int stamp;          // lines start with the time they are written
+    uint64_t random;
+};
+
+static int      generate(int argc, char **argv);
+static int      measure_latency(void);
+static int      print_clock(void);
+static int      parse_dist(const char *str, struct generator *gen);
+static size_t   next_length(struct generator *gen);
+static uint64_t next_random(struct generator *gen);
+static uint64_t now_us(void);
+static void     sleep_until(uint64_t time);
+static int      write_all(int fd, const char *buf, size_t size);
+
+int main(int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "gen") == 0) {
+        return generate(argc - 1, argv + 1) == -1 ? 1 : 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "latency") == 0) {
+        return measure_latency() == -1 ? 1 : 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "clock") == 0) {
+        return print_clock() == -1 ? 1 : 0;
+    }
+    fputs("Usage: xbench gen [-n bytes] [-l fixed:N|uniform:M-N|exp:N] [-r rate] [-B burst] [-T]\n"
+          "       xbench latency\n"
+          "       xbench clock\n", stderr);
+    return 1;
+}
+
+// generate writes lines of random letters to stdout. With -T, each line
+// starts with the time in microseconds it is written.
+//
+// Returns 0 on success or -1 on error.
+int generate(int argc, char **argv)
+{
+    struct generator gen = {
+        .total  = 64 * 1024 * 1024,
+        .dist   = dist_fixed,
+        .min    = 1,
+        .max    = 100,
+        .mean   = 100,
+        .rate   = 0,
+        .burst  = 1,
+        .stamp  = 0,
+        .random = 88172645463325252u,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:l:r:B:T")) != -1) {
+        switch (opt) {
+          case 'n':
+            gen.total = strtoumax(optarg, NULL, 10);
+            break;
+
+          case 'l':
+            if (parse_dist(optarg, &gen) == -1) {
+                fputs("xbench: invalid line length\n", stderr);
+                return -1;
+            }
+            break;
+
+          case 'r':
+            gen.rate = strtod(optarg, NULL);
+            break;
+
+          case 'B':
+            gen.burst = (size_t) strtoul(optarg, NULL, 10);
+            if (gen.burst == 0) {
+                gen.burst = 1;
+            }
+            break;
+
+          case 'T':
+            gen.stamp = 1;
+            break;
+
+          default:
+            return -1;
+        }
+    }
+
+    // Lines are formatted into a buffer and written a burst at a time.
+    size_t capacity = 1 << 16;
+    char *buf = malloc(capacity);
+    if (buf == NULL) {
+        perror("xbench: failed to allocate memory");
+        return -1;
+    }
+
+    uint64_t start = now_us();
+    uintmax_t written = 0;
+    uintmax_t lines = 0;
+
+    while (written < gen.total) {
+        if (gen.rate > 0) {
+            sleep_until(start + (uint64_t) ((double) lines * 1e6 / gen.rate));
+        }
+
+        size_t size = 0;
+        for (size_t i = 0; i < gen.burst && written + size < gen.total; i++) {
+            size_t length = next_length(&gen);
+            if (size + length + 32 > capacity) {
+                char *grown = realloc(buf, capacity * 2 + length);
+                if (grown == NULL) {
+                    perror("xbench: failed to allocate memory");
+                    free(buf);
+                    return -1;
+                }
+                buf = grown;
+                capacity = capacity * 2 + length;
+            }
+
+            size_t prefix = 0;
+            if (gen.stamp) {
+                prefix = (size_t) sprintf(buf + size, "%" PRIu64 " ", now_us());
+            }
+            for (size_t j = prefix; j < length; j++) {
+                buf[size + j] = (char) ('a' + next_random(&gen) % 26);
+            }
+            if (length < prefix) {
+                length = prefix;
+            }
+            buf[size + length] = '\n';
+            size += length + 1;
+            lines++;
+        }
+
+        if (write_all(STDOUT_FILENO, buf, size) == -1) {
+            perror("xbench: failed to write");
+            free(buf);
+            return -1;
+        }
+        written += size;
+    }
+
+    free(buf);
+    return 0;
+}
+
+// measure_latency reads lines starting with a time written by generate -T and
+// prints the time elapsed since then in microseconds for each line.
+//
+// Returns 0 on success or -1 on error.
+int measure_latency(void)
+{
+    char *line = NULL;
+    size_t capacity = 0;
+
+    while (getline(&line, &capacity, stdin) != -1) {
+        uint64_t now = now_us();
+        uint64_t stamp = strtoull(line, NULL, 10);
+        printf("%" PRIu64 "\n", now > stamp ? now - stamp : 0);
+    }
+    free(line);
+    return ferror(stdin) || fflush(stdout) == EOF ? -1 : 0;
+}
+
+// print_clock prints the monotonic time in microseconds.
+//
+// Returns 0 on success or -1 on error.
+int print_clock(void)
+{
+    return printf("%" PRIu64 "\n", now_us()) < 0 ? -1 : 0;
+}
+
+// parse_dist parses the distribution of line lengths: "fixed:N",
+// "uniform:M-N" or "exp:N" for mean N.
+//
+// Returns 0 on success or -1 on error.
+int parse_dist(const char *str, struct generator *gen)
+{
+    char *end;
+
+    if (strncmp(str, "fixed:", 6) == 0) {
+        gen->dist = dist_fixed;
+        gen->mean = (size_t) strtoul(str + 6, &end, 10);
+        return *end == '\0' ? 0 : -1;
+    }
+    if (strncmp(str, "uniform:", 8) == 0) {
+        gen->dist = dist_uniform;
+        gen->min = (size_t) strtoul(str + 8, &end, 10);
+        if (*end != '-') {
+            return -1;
+        }
+        gen->max = (size_t) strtoul(end + 1, &end, 10);
+        return *end == '\0' && gen->min <= gen->max ? 0 : -1;
+    }
+    if (strncmp(str, "exp:", 4) == 0) {
+        gen->dist = dist_exp;
+        gen->mean = (size_t) strtoul(str + 4, &end, 10);
+        return *end == '\0' && gen->mean > 0 ? 0 : -1;
+    }
+    return -1;
+}
+
+// next_length picks the length of the next line without newline.
+//
+// Returns the length.
+size_t next_length(struct generator *gen)
+{
+    switch (gen->dist) {
+      case dist_uniform:
+        return gen->min + (size_t) (next_random(gen) % (gen->max - gen->min + 1));
+
+      case dist_exp: {
+        // Inverse transform of a uniform sample in (0, 1].
+        double u = ((double) (next_random(gen) >> 11) + 1) / 9007199254740992.0;
+        double x = 0;
+        for (double p = 1; p > u; p *= 1 - 1.0 / (double) gen->mean) {
+            x++; // Geometric distribution, the discrete exponential.
+        }
+        return (size_t) x;
+      }
+
+      default:
+        return gen->mean;
+    }
+}
+
+// next_random advances the xorshift64 state of the generator.
+//
+// Returns a pseudo-random number.
+uint64_t next_random(struct generator *gen)
+{
+    gen->random ^= gen->random << 13;
+    gen->random ^= gen->random >> 7;
+    gen->random ^= gen->random << 17;
+    return gen->random;
+}
+
+// now_us reads the monotonic clock, which is shared by all processes.
+//
+// Returns the time in microseconds.
+uint64_t now_us(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000 + (uint64_t) time.tv_nsec / 1000;
+}
+
+// sleep_until sleeps until the monotonic clock reaches time in microseconds.
+void sleep_until(uint64_t time)
+{
+    uint64_t now = now_us();
+    if (now >= time) {
+        return;
+    }
+    struct timespec delay = {
+        .tv_sec  = (time_t) ((time - now) / 1000000),
+        .tv_nsec = (long) ((time - now) % 1000000 * 1000),
+    };
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR) {
+        // Sleep the rest.
+    }
+}
+
+// write_all writes data to fd, retrying partial writes.
+//
+// Returns 0 on success or -1 on error.
+int write_all(int fd, const char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t nb_written = write(fd, buf, size);
+        if (nb_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += nb_written;
+        size -= (size_t) nb_written;
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh -eu
+set -eu
+
+# Chunks grow for commands dominated by fixed cost.
+tmp="$(mktemp -d)"
+trap 'rm -rf "${tmp}"' EXIT
+seq 40000 > "${tmp}/input"
+
+stats="$(xpipe -b 64K --adaptive=1K..64K --stats-interval=1h sh -c 'sleep 0.05; cat > /dev/null' \
+    < "${tmp}/input" 2>&1 > /dev/null)"
+commands="$(echo "${stats}" | sed 's/.* commands=\([0-9]*\) .*/\1/')"
+
+test "${commands}" -lt 30
+
+# Input is passed through intact.
+actual="$(xpipe -b 64K --adaptive=1K..64K -j 4 -k cat < "${tmp}/input" | cksum)"
+expected="$(cksum < "${tmp}/input")"
+
+test x"${actual}" = x"${expected}"
+
+# Invalid ranges.
+if xpipe -b 1K --adaptive=1K..2K cat < /dev/null 2> /dev/null; then
+    exit 1 # Unexpected success
+fi
+if xpipe --adaptive -P cat < /dev/null 2> /dev/null; then
+    exit 1 # Unexpected success
+fi
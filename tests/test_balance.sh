@@ -0,0 +1,34 @@
+#!/bin/sh -eu
+set -eu
+
+lock="$(mktemp -u)"
+trap 'rm -rf "${lock}"' EXIT
+
+# Ten chunks of two lines arrive slowly. One of two workers takes long to
+# start reading its input.
+produce() {
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        printf "x\nx\n"
+        sleep 0.1
+    done
+}
+worker='if mkdir "$0" 2>/dev/null; then sleep 2; echo slow $(tr -d "\0" | wc -l); else echo fast $(tr -d "\0" | wc -l); fi'
+
+# The workers take turns.
+actual="$(produce | xpipe -b 4 -j 2 --balance=round-robin sh -c "${worker}" "${lock}")"
+
+expected="\
+fast 10
+slow 10"
+
+test x"${actual}" = x"${expected}"
+
+# The slow worker receives one chunk before its pipe has unread data.
+rm -rf "${lock}"
+actual="$(produce | xpipe -b 4 -j 2 --balance=least-loaded sh -c "${worker}" "${lock}")"
+
+expected="\
+fast 18
+slow 2"
+
+test x"${actual}" = x"${expected}"
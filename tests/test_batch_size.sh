@@ -0,0 +1,19 @@
+#!/bin/sh -eu
+set -eu
+
+# Chunks of up to three lines regardless of the buffer size.
+actual="$(seq 10 | xpipe -n 3 awk 'END { print NR }' | tr '\n' ' ')"
+expected="3 3 3 1 "
+
+test x"${actual}" = x"${expected}"
+
+# Chunks of up to 8 bytes with a larger buffer. A longer line is sent with
+# the lines read along with it.
+actual="$(printf "aaa\nbbb\nccc\nddddddddddd\ne\n" | xpipe -b 64 -s 8 awk 'END { print NR }' | tr '\n' ' ')"
+expected="2 1 2 "
+
+test x"${actual}" = x"${expected}"
+
+if echo | xpipe -b 8 -s 9 cat 2> /dev/null; then
+    exit 1 # Chunk size must not exceed buffer size
+fi
@@ -0,0 +1,28 @@
+#!/bin/sh -eu
+set -eu
+
+# Lines written in pieces by concurrent commands are not mixed.
+actual="$(seq 20 | xpipe -n 1 -j 8 -c sh -c 'read x; printf "a%s" "$x"; sleep 0.1; printf "b%s\n" "$x"' \
+    | grep -cv '^a\([0-9]*\)b\1$' || true)"
+
+test x"${actual}" = x"0"
+
+# A line longer than the buffer is written in pieces without interruption.
+actual="$(seq 4 | xpipe -b 16 -n 1 -j 4 -c sh -c 'read x; head -c 100 /dev/zero | tr "\0" "$x"; echo' \
+    | sed 's/^\(.\)\1*$/ok/' | tr '\n' ' ')"
+expected="ok ok ok ok "
+
+test x"${actual}" = x"${expected}"
+
+# Output not terminated by a newline is written when the command exits.
+actual="$(printf "a\nb\n" | xpipe -n 1 -c sh -c 'tr -d "\n"')"
+
+test x"${actual}" = x"ab"
+
+# Records end with the input delimiter.
+actual="$(printf "a\0b\0" | xpipe -0 -n 1 -j 2 -c cat | tr '\0' '\n' | sort)"
+expected="\
+a
+b"
+
+test x"${actual}" = x"${expected}"
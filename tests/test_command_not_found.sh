@@ -0,0 +1,11 @@
+#!/bin/sh -eu
+set -eu
+
+# The command is looked up in PATH once on startup.
+if echo "Lorem ipsum" | xpipe xpipe-no-such-command 2> /dev/null; then
+    exit 1 # Unexpected success
+fi
+
+actual="$(echo "Lorem ipsum" | PATH=/nonexistent:${PATH} xpipe cat)"
+
+test x"${actual}" = x"Lorem ipsum"
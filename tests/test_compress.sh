@@ -0,0 +1,54 @@
+#!/bin/sh -eu
+set -eu
+
+# Threads only compress chunks.
+if xpipe --compress-threads=2 cat < /dev/null 2> /dev/null; then
+    exit 1 # Unexpected success
+fi
+
+if ! xpipe --compress=gzip cat < /dev/null 2> /dev/null; then
+    exit 77 # Skipped: built without zlib.
+fi
+
+# Each chunk is a gzip member of its own.
+actual="$(printf "a\nb\nc\n" | xpipe -b 2 -k --compress=gzip sh -c 'gzip -dc; echo .')"
+
+expected="\
+a
+.
+b
+.
+c
+."
+
+test x"${actual}" = x"${expected}"
+
+# Level and batches by key.
+actual="$(seq 1 10000 | xpipe -k --key=b1-1 --compress=gzip:1 gzip -dc | sort -n | cksum)"
+expected="$(seq 1 10000 | cksum)"
+
+test x"${actual}" = x"${expected}"
+
+# Compressor threads keep chunks in order.
+actual="$(seq 1 10000 | xpipe -n 100 -j 4 -k --compress=gzip --compress-threads=3 gzip -dc | cksum)"
+expected="$(seq 1 10000 | cksum)"
+
+test x"${actual}" = x"${expected}"
+
+# Chunks are compressed before the rest of the input moves over them in a
+# buffer that is not mirrored, which is used when address space is too tight
+# to map the buffer twice.
+for threads in 0 3; do
+    actual="$(seq 1 20000 | (ulimit -v 327680 && xpipe -b 128M -n 100 --compress=gzip --compress-threads=${threads} gzip -dc) | cksum)"
+    expected="$(seq 1 20000 | cksum)"
+
+    test x"${actual}" = x"${expected}"
+done
+
+# Compressed chunks count toward --mem, so input is not read ahead while the
+# command stalls.
+if [ -r /proc/self/status ]; then
+    actual="$(seq 1 5000000 | xpipe -P --mem=256K -b 64K --compress=gzip:1 sh -c 'sleep 1; grep VmRSS /proc/$PPID/status; cat > /dev/null' | awk '{ print $2 }')"
+
+    test "${actual}" -lt 8192
+fi
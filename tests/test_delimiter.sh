@@ -0,0 +1,63 @@
+#!/bin/sh -eu
+set -eu
+
+# NUL-terminated records.
+actual="$(printf "a b\0c\nd\0e\0" | xpipe -0 -n 2 sh -c 'tr "\0" "|"; echo')"
+
+expected="\
+a b|c
+d|
+e|"
+
+test x"${actual}" = x"${expected}"
+
+# Multi-byte delimiter split across reads and chunks.
+actual="$(printf "ab\r\ncd\r\nef\r\n" | xpipe -d '\r\n' -b 5 sh -c 'tr "\r\n" "<>"; echo')"
+
+expected="\
+ab<>
+cd<>
+ef<>"
+
+test x"${actual}" = x"${expected}"
+
+# Multi-byte delimiter of a record longer than the buffer.
+actual="$(printf "abcdefg--h--" | xpipe -d -- -b 4 sh -c 'cat; echo')"
+
+expected="\
+abcdefg--
+h--"
+
+test x"${actual}" = x"${expected}"
+
+# Keys of delimited records exclude the delimiter.
+actual="$(printf "x,1;y,2;x,3;" | xpipe -d ';' --key=1:, sh -c 'printf "{}="; cat; echo' | sort)"
+
+expected="\
+x=x,1;x,3;
+y=y,2;"
+
+test x"${actual}" = x"${expected}"
+
+# Length-prefixed records are never split.
+actual="$(printf "\0\0\0\2ab\0\0\0\1c\0\0\0\3def" | xpipe --framing=u32be -b 12 sh -c 'od -An -c | tr -s " \n" " "; echo')"
+
+expected="\
+ \\0 \\0 \\0 002 a b \\0 \\0 \\0 001 c 
+ \\0 \\0 \\0 003 d e f "
+
+test x"${actual}" = x"${expected}"
+
+# Length-prefixed record longer than the buffer.
+actual="$(printf "\0\0\0\6abcdef\0\0\0\1g" | xpipe --framing=u32be -b 5 sh -c 'tail -c +5; echo')"
+
+expected="\
+abcdef
+g"
+
+test x"${actual}" = x"${expected}"
+
+# Invalid delimiter.
+if xpipe -d '\q' cat < /dev/null 2> /dev/null; then
+    exit 1 # Unexpected success
+fi
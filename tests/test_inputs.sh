@@ -0,0 +1,82 @@
+#!/bin/sh -eu
+set -eu
+
+tmp="$(mktemp -d)"
+trap 'rm -rf "${tmp}"' EXIT
+
+# Files and stdin, with the last records terminated.
+printf "a1\na2\na3" > "${tmp}/a"
+printf "b1\nb2" > "${tmp}/b"
+actual="$(printf "c1\n" | xpipe -n 1 -i "${tmp}/a" -i "${tmp}/b" -i - cat | sort)"
+
+expected="\
+a1
+a2
+a3
+b1
+b2
+c1"
+
+test x"${actual}" = x"${expected}"
+
+# Partial lines of a FIFO are not mixed with lines of another input.
+mkfifo "${tmp}/fifo"
+(printf "x"; sleep 0.2; printf "yz\n") > "${tmp}/fifo" &
+actual="$( (sleep 0.1; printf "q\n") | xpipe -i "${tmp}/fifo" -i - cat | sort)"
+wait
+
+expected="\
+q
+xyz"
+
+test x"${actual}" = x"${expected}"
+
+# A FIFO without writer does not hold up other inputs. The writer of the first
+# FIFO appears only after the line of the second FIFO is processed.
+mkfifo "${tmp}/fifo1" "${tmp}/fifo2"
+printf "b\n" > "${tmp}/fifo2" &
+(
+    for i in $(seq 50); do
+        if grep -q b "${tmp}/out" 2> /dev/null; then
+            break
+        fi
+        sleep 0.1
+    done
+    printf "a\n" > "${tmp}/fifo1"
+) &
+xpipe -n 1 -i "${tmp}/fifo1" -i "${tmp}/fifo2" sh -c 'cat >> "$1"' - "${tmp}/out"
+wait
+actual="$(cat "${tmp}/out")"
+
+expected="\
+b
+a"
+
+test x"${actual}" = x"${expected}"
+
+# Records longer than the buffer, with a delimiter split across pieces.
+printf "aaaXYbXY" > "${tmp}/a"
+printf "cccccXYdXY" > "${tmp}/b"
+actual="$(xpipe -b 4 -d XY -i "${tmp}/a" -i "${tmp}/b" sh -c 'cat; echo' | sort)"
+
+expected="\
+aaaXY
+bXY
+cccccXY
+dXY"
+
+test x"${actual}" = x"${expected}"
+
+# Truncated length-prefixed record.
+printf "\0\0\0\2ab\0\0\0\4cd" > "${tmp}/a"
+actual="$(xpipe --framing=u32be -i "${tmp}/a" -i /dev/null cat 2> "${tmp}/err" | od -An -tx1 | tr -s ' \n' ' ')"
+
+expected=" 00 00 00 02 61 62 00 00 00 04 63 64 00 00 "
+
+test x"${actual}" = x"${expected}"
+grep -q "truncated record" "${tmp}/err"
+
+# Missing input.
+if xpipe -i "${tmp}/missing" cat 2> /dev/null; then
+    exit 1 # Unexpected success
+fi
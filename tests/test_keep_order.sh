@@ -0,0 +1,20 @@
+#!/bin/sh -eu
+set -eu
+
+# Earlier chunks take longer to process. Outputs should still come out in the
+# order of input.
+actual="$(printf "3\n2\n1\n0\n" | xpipe -b 2 -j 4 -k sh -c 'read n; sleep $n; echo $n')"
+
+expected="\
+3
+2
+1
+0"
+
+test x"${actual}" = x"${expected}"
+
+# Large outputs must not dead-lock while the commands wait for their turn.
+actual="$(seq 100000 | xpipe -b 65536 -j 3 --keep-order cat | cksum)"
+expected="$(seq 100000 | cksum)"
+
+test x"${actual}" = x"${expected}"
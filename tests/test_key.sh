@@ -0,0 +1,52 @@
+#!/bin/sh -eu
+set -eu
+
+# Lines are batched by the first tab-delimited field, and batches are sent in
+# order of their first lines at EOF.
+actual="$(printf "a\t1\nb\t2\na\t3\nc\t4\nb\t5\n" | xpipe -k --key=1 sh -c 'echo "[{}]"; cat; echo')"
+
+expected="\
+[a]
+a	1
+a	3
+
+[b]
+b	2
+b	5
+
+[c]
+c	4"
+
+test x"${actual}" = x"${expected}"
+
+# Each key has its own number of lines and the key can be in an argument.
+actual="$(printf "x,a\ny,b\nz,a\nw,a\n" | xpipe -k -n 2 --key=2:, echo key={})"
+
+expected="\
+key=a
+key=b
+key=a"
+
+test x"${actual}" = x"${expected}"
+
+# Byte range, with an empty key for a short line.
+actual="$(printf "2024-01-01 x\n2024-01-02 y\n2024-01-01 z\nshort\n" | xpipe -k --key=b1-10 sh -c 'echo "<{}>" $(cat)')"
+
+expected="\
+<2024-01-01> 2024-01-01 x 2024-01-01 z
+<2024-01-02> 2024-01-02 y
+<short> short"
+
+test x"${actual}" = x"${expected}"
+
+# Batches are not lost when they are sent early for lack of memory.
+actual="$(seq 1 20000 | xpipe --key=b1-3 --mem 8K -j 2 cat | sort | cksum)"
+expected="$(seq 1 20000 | sort | cksum)"
+
+test x"${actual}" = x"${expected}"
+
+# Large batches reuse pooled buffers.
+actual="$(seq 1 200000 | xpipe -b 1M -s 256K --key=b1-1 --prefault cat | sort | cksum)"
+expected="$(seq 1 200000 | sort | cksum)"
+
+test x"${actual}" = x"${expected}"
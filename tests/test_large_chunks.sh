@@ -0,0 +1,13 @@
+#!/bin/sh -eu
+set -eu
+
+# Chunks larger than the pipe capacity go through the zero-copy path on Linux.
+# Data must be intact although the buffer is reused for the next chunk.
+actual="$(seq 500000 | xpipe -b 1048576 -j 2 -k cat | cksum)"
+expected="$(seq 500000 | cksum)"
+
+test x"${actual}" = x"${expected}"
+
+actual="$(seq 500000 | xpipe -b 1048576 -P cat | tr -d '\0' | cksum)"
+
+test x"${actual}" = x"${expected}"
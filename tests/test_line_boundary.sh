@@ -0,0 +1,17 @@
+#!/bin/sh -eu
+set -eu
+
+# Chunks end at the last newline in the buffer wherever it falls relative to
+# 16-byte blocks, with lines of 1 to 39 characters.
+input="$(awk 'BEGIN { for (i = 0; i < 200; i++) { printf "%0" (i % 40) "d\n", 0 } }')"
+
+for bufsize in 17 31 32 33 48 100; do
+    actual="$(printf "%s\n" "${input}" | xpipe -b ${bufsize} -k cat)"
+
+    test x"${actual}" = x"${input}"
+
+    # No line is split between chunks.
+    actual="$(printf "%s\n" "${input}" | xpipe -b ${bufsize} -k awk 'END { print NR }' | awk '{ n += $1 } END { print n }')"
+
+    test x"${actual}" = x"200"
+done
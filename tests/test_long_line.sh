@@ -0,0 +1,29 @@
+#!/bin/sh -eu
+set -eu
+
+# A line longer than the buffer is sent as a chunk of its own.
+long="$(printf "%01000d" 0)"
+
+actual="$(printf "a\n%s\nb\n" "${long}" | xpipe -b 16 -k wc -c | tr -d ' ')"
+
+expected="\
+2
+1001
+2"
+
+test x"${actual}" = x"${expected}"
+
+# The last line without newline.
+actual="$(printf "a\n%s" "${long}" | xpipe -b 16 -k wc -c | tr -d ' ')"
+
+expected="\
+2
+1000"
+
+test x"${actual}" = x"${expected}"
+
+# Lines are passed through intact.
+input="$(printf "%s\n" a "${long}" b "${long}" c)"
+actual="$(printf "%s\n" "${input}" | xpipe -b 16 -j 3 -k cat)"
+
+test x"${actual}" = x"${input}"
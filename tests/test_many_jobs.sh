@@ -0,0 +1,13 @@
+#!/bin/sh -eu
+set -eu
+
+# More descriptors than select() can watch: stdin and stdout pipes of each of
+# 600 commands running concurrently.
+if ! ulimit -n 4096 2>/dev/null; then
+    exit 77 # Skipped: cannot raise the limit.
+fi
+
+actual="$(seq 1 3000 | xpipe -b 10 -j 600 -k sh -c 'sleep 0.5; cat' | cksum)"
+expected="$(seq 1 3000 | cksum)"
+
+test x"${actual}" = x"${expected}"
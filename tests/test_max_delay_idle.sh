@@ -0,0 +1,49 @@
+#!/bin/sh -eu
+set -eu
+
+slow_source() {
+    printf "line\npart"
+    sleep 2
+    printf "ial\n"
+    sleep 0.5
+    printf "more\n"
+    sleep 1.5
+}
+
+# A line carried over after flushing preceding lines is sent as soon as it
+# completes if it is overdue, and the next line is sent on its own deadline.
+actual="$(slow_source | xpipe --max-delay=1 awk '{ print NR, $0 }')"
+
+expected="\
+1 line
+1 partial
+1 more"
+
+test x"${actual}" = x"${expected}"
+
+# -t does not rearm the timeout for the carried over line.
+actual="$(slow_source | xpipe -t 1 awk '{ print NR, $0 }')"
+
+expected="\
+1 line
+1 partial
+2 more"
+
+test x"${actual}" = x"${expected}"
+
+bursty_source() {
+    printf "a\n"
+    sleep 0.2
+    printf "b\n"
+    sleep 1
+    printf "c\n"
+}
+
+actual="$(bursty_source | xpipe --idle=500ms awk '{ print NR, $0 }')"
+
+expected="\
+1 a
+2 b
+1 c"
+
+test x"${actual}" = x"${expected}"
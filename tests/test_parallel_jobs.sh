@@ -0,0 +1,23 @@
+#!/bin/sh -eu
+set -eu
+
+# Each line becomes a chunk and each command takes a second. Four concurrent
+# jobs should finish well within the four seconds taken by serial execution.
+start=$(date +%s)
+actual="$(printf "a\nb\nc\nd\n" | xpipe -b 2 -j 4 sh -c 'sleep 1; cat' | sort)"
+end=$(date +%s)
+
+expected="\
+a
+b
+c
+d"
+
+test x"${actual}" = x"${expected}"
+test $((end - start)) -lt 3
+
+if printf "a\nb\nc\n" | xpipe -b 2 -j 2 awk '{ exit 123 }'; then
+    exit 1 # Unexpected success
+else
+    test $? -eq 123
+fi
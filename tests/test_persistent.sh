@@ -0,0 +1,39 @@
+#!/bin/sh -eu
+set -eu
+
+# A single worker receives all chunks, each terminated by NUL by default.
+actual="$(printf "a\nb\nc\n" | xpipe -b 2 -P sh -c 'echo start; tr "\0" "|"')"
+
+expected="\
+start
+a
+|b
+|c
+|"
+
+test x"${actual}" = x"${expected}"
+
+# Delimiter record.
+actual="$(printf "a\nb\n" | xpipe -b 2 -P --batch-frame=record:END cat)"
+
+expected="\
+a
+END
+b
+END"
+
+test x"${actual}" = x"${expected}"
+
+# Length prefix.
+actual="$(printf "ab\nc\n" | xpipe -b 3 -P --batch-frame=u32be od -An -tx1 | tr -s ' \n' ' ')"
+
+expected=" 00 00 00 03 61 62 0a 00 00 00 02 63 0a "
+
+test x"${actual}" = x"${expected}"
+
+# Failure of a worker.
+if printf "a\nb\n" | xpipe -b 2 -j 2 -P sh -c 'cat > /dev/null; exit 123'; then
+    exit 1 # Unexpected success
+else
+    test $? -eq 123
+fi
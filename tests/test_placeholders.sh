@@ -0,0 +1,37 @@
+#!/bin/sh -eu
+set -eu
+
+# Chunk metadata in arguments and environment.
+actual="$(seq 10 | xpipe -n 3 sh -c 'cat > /dev/null; echo "$0 $1 $2 $3 / $XPIPE_SEQ $XPIPE_BYTES $XPIPE_LINES $XPIPE_OFFSET"' \
+    '{seq}' 'b={bytes}' '{lines}' '{offset}')"
+
+expected="\
+0 b=6 3 0 / 0 6 3 0
+1 b=6 3 6 / 1 6 3 6
+2 b=6 3 12 / 2 6 3 12
+3 b=3 1 18 / 3 3 1 18"
+
+test x"${actual}" = x"${expected}"
+
+# Keys, and unknown placeholders left as is.
+actual="$(printf "a\t1\nb\t2\n" | xpipe --key=1 sh -c 'cat > /dev/null; echo "$0 $1 $XPIPE_KEY"' \
+    'k={key}' '{} {nope}' | sort)"
+
+expected="\
+k=a a {nope} a
+k=b b {nope} b"
+
+test x"${actual}" = x"${expected}"
+
+# A retried chunk keeps its sequence number.
+tmp="$(mktemp -d)"
+trap 'rm -rf "${tmp}"' EXIT
+
+actual="$(seq 4 | xpipe -n 2 --retry=1 --backoff=10ms sh -c \
+    'cat > /dev/null; mkdir "$0/{seq}" 2> /dev/null && exit 1; echo {seq}' "${tmp}")"
+
+expected="\
+0
+1"
+
+test x"${actual}" = x"${expected}"
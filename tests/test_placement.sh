@@ -0,0 +1,44 @@
+#!/bin/sh -eu
+set -eu
+
+# One command per available CPU.
+actual="$(seq 100 | xpipe -j auto -n 1 cat | wc -l | tr -d ' ')"
+
+test x"${actual}" = x"100"
+
+# Commands run at lower priority.
+actual="$(echo | xpipe --nice=5 sh -c 'cat > /dev/null; nice')"
+expected="$(( $(nice) + 5 ))"
+
+test x"${actual}" = x"${expected}"
+
+# Invalid I/O scheduling classes are rejected.
+for class in foo best-effort:8 idle:1; do
+    if xpipe --ionice=${class} cat < /dev/null 2> /dev/null; then
+        exit 1 # Unexpected success
+    fi
+done
+
+# Commands run in the I/O scheduling class given.
+if command -v ionice > /dev/null && [ "$(uname)" = Linux ]; then
+    actual="$(echo | xpipe --ionice=idle sh -c 'cat > /dev/null; ionice')"
+
+    test x"${actual}" = x"idle"
+
+    actual="$(echo | xpipe --ionice=best-effort:2 sh -c 'cat > /dev/null; ionice')"
+
+    test x"${actual}" = x"best-effort: prio 2"
+fi
+
+if [ ! -r /proc/self/status ]; then
+    exit 77 # Skipped: cannot check CPUs of commands.
+fi
+
+# Commands are pinned to the CPUs given.
+actual="$(echo | xpipe --cpus=0 sh -c 'cat > /dev/null; grep Cpus_allowed_list /proc/self/status')"
+
+test x"${actual}" = x"Cpus_allowed_list:	0"
+
+if xpipe --cpus=1-0 cat < /dev/null 2> /dev/null; then
+    exit 1 # Unexpected success
+fi
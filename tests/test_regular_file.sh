@@ -0,0 +1,30 @@
+#!/bin/sh -eu
+set -eu
+
+tmp="$(mktemp -d)"
+trap 'rm -rf "${tmp}"' EXIT
+seq 100000 > "${tmp}/input"
+
+# A regular file is cut into chunks in place.
+actual="$(xpipe -b 64K -j 4 -k cat < "${tmp}/input" | cksum)"
+expected="$(cksum < "${tmp}/input")"
+
+test x"${actual}" = x"${expected}"
+
+# Chunks are limited by records and bytes as with a stream.
+seq 10 > "${tmp}/short"
+actual="$(xpipe -n 3 awk 'END { print NR }' < "${tmp}/short" | tr '\n' ' ')"
+expected="3 3 3 1 "
+
+test x"${actual}" = x"${expected}"
+
+printf "aaa\nbbb\nccc\nddddddddddd\ne\n" > "${tmp}/long"
+actual="$(xpipe -b 64 -s 8 awk 'END { print NR }' < "${tmp}/long" | tr '\n' ' ')"
+expected="2 1 1 1 "
+
+test x"${actual}" = x"${expected}"
+
+# Input starts at the current file position.
+actual="$( (head -c 6 > /dev/null; xpipe cat) < "${tmp}/input" | head -n 1)"
+
+test x"${actual}" = x"4"
@@ -0,0 +1,54 @@
+#!/bin/sh -eu
+set -eu
+
+STATE="$(mktemp -d)"
+export STATE
+trap 'rm -rf "${STATE}"' EXIT
+
+# Each chunk fails twice before its command succeeds.
+flaky='read line; echo >> "${STATE}/${line}";
+       test $(wc -l < "${STATE}/${line}") -gt 2 || exit 3; echo "${line}"'
+
+actual="$(printf "a\nb\nc\n" | xpipe -b 2 -j 2 -k --retry=2 --backoff=10ms..20ms sh -c "${flaky}")"
+
+expected="\
+a
+b
+c"
+
+test x"${actual}" = x"${expected}"
+
+# Out of retries.
+rm -f "${STATE}"/*
+if printf "a\n" | xpipe --retry=1 --backoff=10ms sh -c "${flaky}"; then
+    exit 1 # Unexpected success
+else
+    test $? -eq 3
+fi
+
+# A command killed by a signal is retried, and fails with 128 plus the signal
+# number when out of retries.
+rm -f "${STATE}"/*
+killed='read line; echo >> "${STATE}/${line}";
+        test $(wc -l < "${STATE}/${line}") -gt 1 || kill -9 $$; echo "${line}"'
+
+actual="$(printf "a\n" | xpipe --retry=1 --backoff=10ms sh -c "${killed}")"
+
+test x"${actual}" = x"a"
+
+rm -f "${STATE}"/*
+if printf "a\n" | xpipe sh -c "${killed}"; then
+    exit 1 # Unexpected success
+else
+    test $? -eq 137
+fi
+
+# Chunks passed as files are retried as well.
+rm -f "${STATE}"/*
+actual="$(printf "a\nb\n" | xpipe -b 2 -k --stdin=memfd --retry=2 --backoff=10ms sh -c "${flaky}")"
+
+expected="\
+a
+b"
+
+test x"${actual}" = x"${expected}"
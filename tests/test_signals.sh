@@ -0,0 +1,64 @@
+#!/bin/sh -eu
+set -eu
+
+tmp="$(mktemp -d)"
+trap 'rm -rf "${tmp}"' EXIT
+mkfifo "${tmp}/fifo"
+
+# SIGTERM stops input and sends buffered data, including a partial line.
+(printf "a\nb\nc"; sleep 3) > "${tmp}/fifo" &
+xpipe -b 1K cat < "${tmp}/fifo" > "${tmp}/out" &
+pid=$!
+sleep 0.5
+kill -TERM "${pid}"
+wait "${pid}"
+
+actual="$(cat "${tmp}/out")"
+expected="\
+a
+b
+c"
+
+test x"${actual}" = x"${expected}"
+
+# Commands still running after the grace period are killed.
+(printf "a\n"; sleep 3) > "${tmp}/fifo" &
+xpipe --grace=100ms sh -c 'sleep 3' < "${tmp}/fifo" &
+pid=$!
+sleep 0.5
+kill -TERM "${pid}"
+status=0
+wait "${pid}" || status=$?
+
+test "${status}" -eq 143
+
+# SIGHUP sends buffered lines at once.
+(printf "a\nb\n"; sleep 1; printf "c\n") > "${tmp}/fifo" &
+xpipe -b 1K sh -c 'echo chunk; cat' < "${tmp}/fifo" > "${tmp}/out" &
+pid=$!
+sleep 0.5
+kill -HUP "${pid}"
+wait "${pid}"
+
+actual="$(cat "${tmp}/out")"
+expected="\
+chunk
+a
+b
+chunk
+c"
+
+test x"${actual}" = x"${expected}"
+
+# The rest of a regular file is left unread.
+seq 10000 > "${tmp}/input"
+exec 3< "${tmp}/input"
+xpipe -n 100 sh -c 'sleep 0.1; cat' <&3 > "${tmp}/out" &
+pid=$!
+sleep 0.3
+kill -TERM "${pid}"
+wait "${pid}"
+cat <&3 >> "${tmp}/out"
+exec 3<&-
+
+cmp "${tmp}/out" "${tmp}/input"
@@ -0,0 +1,50 @@
+#!/bin/sh -eu
+set -eu
+
+marker="$(mktemp -u)"
+trap 'rm -f "${marker}"' EXIT
+
+# Input of two 256 KiB chunks. The commands report whether all input has been
+# read by the time they get to reading theirs.
+produce() {
+    yes abcdefg | head -c 524288
+    touch "${marker}"
+}
+check='sleep 1; test -e "$0" && echo read || echo blocked; cat > /dev/null'
+
+# Input is read ahead while the first command is slow to consume its chunk.
+actual="$(produce | xpipe -b 256K --mem 1M sh -c "${check}" "${marker}")"
+
+expected="\
+read
+read"
+
+test x"${actual}" = x"${expected}"
+
+# Reading stops when the memory budget runs out.
+rm -f "${marker}"
+actual="$(produce | xpipe -b 256K --mem 256K sh -c "${check}" "${marker}")"
+
+expected="\
+blocked
+read"
+
+test x"${actual}" = x"${expected}"
+
+# Outputs captured with -k count toward the budget. The second command outputs
+# its chunk while the first one holds up the output order.
+produce_later() {
+    yes abcdefg | head -c 524288
+    sleep 0.5
+    yes abcdefg | head -c 262144
+    touch "${marker}"
+}
+check_first='if [ "${XPIPE_SEQ}" = 0 ]; then '"${check}"'; else cat; fi'
+
+rm -f "${marker}"
+actual="$(produce_later | xpipe -k -j 2 -b 256K --mem 768K sh -c "${check_first}" "${marker}" | grep -v abcdefg)"
+
+expected="\
+blocked"
+
+test x"${actual}" = x"${expected}"
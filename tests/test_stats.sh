@@ -0,0 +1,21 @@
+#!/bin/sh -eu
+set -eu
+
+# Final report with --stats-interval.
+stats="$(printf "a\nb\nc\n" | xpipe -n 2 --stats-interval=1h cat 2>&1 > /dev/null)"
+
+case "${stats}" in
+  "xpipe: stats in=6 out=6 chunks=2 records=3 commands=2 flush=full:0,size:0,count:1,timeout:0,delay:0,idle:0,mem:0,spill:0,eof:1,hangup:0 chunk_bytes=n:2,sum:6,le2:1,le4:1 chunk_records=n:2,sum:3,le1:1,le2:1 "*) ;;
+  *) echo "${stats}"; exit 1 ;;
+esac
+
+# Report on SIGUSR1.
+tmp="$(mktemp -d)"
+trap 'rm -rf "${tmp}"' EXIT
+(echo a; sleep 1; echo b) | xpipe -t 100ms cat > /dev/null 2> "${tmp}/stderr" &
+pid=$!
+sleep 0.5
+kill -USR1 "${pid}"
+wait "${pid}"
+
+grep -q "^xpipe: stats in=2 out=2 chunks=1 records=0 commands=1 flush=.*,timeout:1," "${tmp}/stderr"
@@ -0,0 +1,30 @@
+#!/bin/sh -eu
+set -eu
+
+# Each chunk is a regular file whose size is known up front.
+actual="$(printf "ab\ncd\nef\n" | xpipe -b 6 -k --stdin=memfd sh -c 'wc -c < {file}; cat')"
+
+expected="\
+6
+ab
+cd
+3
+ef"
+
+test x"${actual}" = x"${expected}"
+
+# The file can be read again from the start.
+actual="$(printf "a\nb\n" | xpipe -b 2 -k --stdin=memfd sh -c 'cat {file} {file}')"
+
+expected="\
+a
+a
+b
+b"
+
+test x"${actual}" = x"${expected}"
+
+# Not with persistent workers.
+if printf "a\n" | xpipe -P --stdin=memfd cat 2> /dev/null; then
+    exit 1 # Unexpected success
+fi
@@ -0,0 +1,27 @@
+#!/bin/sh -eu
+set -eu
+
+slow_source() {
+    echo "The quick brown fox"
+    sleep 1
+    echo "jumps over the lazy dog"
+}
+
+actual="$(slow_source | xpipe -t 200ms awk '{ print NR, $0 }')"
+
+# xpipe should launch awk for each line due to time out.
+expected="\
+1 The quick brown fox
+1 jumps over the lazy dog"
+
+test x"${actual}" = x"${expected}"
+
+actual="$(slow_source | xpipe -t 0.2 awk '{ print NR, $0 }')"
+
+test x"${actual}" = x"${expected}"
+
+for timeout in 1x -1 . 1.5ms5; do
+    if echo | xpipe -t "${timeout}" cat 2> /dev/null; then
+        exit 1 # Unexpected success
+    fi
+done
@@ -0,0 +1,20 @@
+#!/bin/sh -eu
+set -eu
+
+# Commands may exit without reading their input.
+seq 1 100000 | xpipe -b 64K -j 2 true
+
+actual="$(seq 1 100000 | xpipe -b 64K -k head -n 1)"
+
+expected="\
+1
+12774
+23696
+34618
+45540
+56462
+67384
+78306
+89228"
+
+test x"${actual}" = x"${expected}"
@@ -1,11 +1,17 @@
 // Distributed under the MIT License
 
-#define _POSIX_C_SOURCE 200112L
+#if defined(__linux__)
+# define _GNU_SOURCE // vmsplice, memfd_create
+#else
+# define _XOPEN_SOURCE 600
+#endif
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -13,47 +19,870 @@
 #include <string.h>
 #include <time.h>
 
-#include <sys/select.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#if !defined(USE_POLL) && defined(__linux__)
+# define HAVE_EPOLL
+#elif !defined(USE_POLL) && (defined(__APPLE__) || defined(__FreeBSD__) || \
+                             defined(__NetBSD__) || defined(__OpenBSD__) || \
+                             defined(__DragonFly__))
+# define HAVE_KQUEUE
+#endif
+
+#if defined(__linux__)
+# define HAVE_SCHED_AFFINITY
+# define HAVE_IOPRIO
+# include <sched.h>
+# include <sys/syscall.h>
+#endif
+
+#if defined(HAVE_EPOLL)
+# include <sys/epoll.h>
+#elif defined(HAVE_KQUEUE)
+# include <sys/event.h>
+#else
+# include <poll.h>
+#endif
+
+#if defined(HAVE_ZLIB)
+# define ZLIB_CONST
+# include <zlib.h>
+#endif
+#if defined(HAVE_ZSTD)
+# include <zstd.h>
+#endif
+#if defined(HAVE_LZ4)
+# include <lz4frame.h>
+#endif
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// NO_MEMRCHR and NO_MEMMEM build the fallbacks even where libc has these, so
+// that they are tested (see `make test-fallback`).
+#if !defined(HAVE_MEMRCHR) && defined(__GLIBC__) && !defined(NO_MEMRCHR)
+# define HAVE_MEMRCHR
+#endif
+#if !defined(HAVE_MEMMEM) && defined(__GLIBC__) && !defined(NO_MEMMEM)
+# define HAVE_MEMMEM
+#endif
+
+#if !defined(HAVE_MEMRCHR) && defined(__SSE2__) && defined(__GNUC__)
+# include <emmintrin.h>
+#elif !defined(HAVE_MEMRCHR) && defined(__ARM_NEON) && defined(__GNUC__)
+# include <arm_neon.h>
+#endif
+
+// Placeholders in the arguments of a command, substituted for each chunk.
+enum
+{
+    ph_key,         // {} or {key}
+    ph_file,        // {file}
+    ph_seq,         // {seq}
+    ph_bytes,       // {bytes}
+    ph_lines,       // {lines}
+    ph_offset,      // {offset}
+    nb_placeholders,
+};
+
+// arg_part is a piece of an argument with placeholders: literal text, or a
+// placeholder.
+struct arg_part
+{
+    size_t arg;         // index of the argument
+    const char *text;   // text in the argument
+    size_t size;
+    int placeholder;    // -1 for literal text
+};
+
+// command is a program to execute for chunks. Arguments with placeholders are
+// parsed into parts once, and only those are rebuilt for each chunk.
+struct command
+{
+    char *path;         // program resolved with PATH
+    char **argv;
+    struct arg_part *parts;
+    size_t nb_parts;
+};
+
+// key_spec selects the key of each line for sharding.
+struct key_spec
+{
+    int type;
+    char delim;         // field delimiter
+    size_t first;       // field number or first byte, counted from 1
+    size_t last;        // last byte
+};
+
+// record_spec defines how input is split into records.
+struct record_spec
+{
+    int type;
+    char *delim;        // delimiter at the end of each record
+    size_t delim_size;
+};
+
+// Types of record_spec.
+enum
+{
+    record_delim,   // records end with a delimiter
+    record_u32be,   // records start with a 32-bit big-endian payload length
+};
+
+// placement is where and at what priority commands run. The CPU set is applied
+// to the thread spawning a command, which the command inherits, and the
+// priorities to the command right after it is spawned.
+struct placement
+{
+    int has_cpus;
+#if defined(HAVE_SCHED_AFFINITY)
+    cpu_set_t cpus;
+    cpu_set_t own_cpus; // affinity of xpipe, restored after each spawn
+#endif
+    int has_nice;
+    int nice;           // nice value of commands
+    int ioprio;         // I/O priority of commands, or -1 if unchanged
+};
+
+// Types of key_spec.
+enum
+{
+    key_none,
+    key_field,
+    key_bytes,
+};
+
 struct config
 {
     size_t buf_size;
-    char **argv;
-    time_t timeout;
+    size_t batch_size;
+    size_t batch_lines;
+    struct command command;
+    struct record_spec record;
+    struct timeval timeout;
+    struct timeval max_delay;
+    struct timeval idle;
+    size_t jobs;
+    size_t mem;
+    int keep_order;
+    int collect;
+    int persistent;
+    int balance;
+    int frame;
+    const char *frame_record;
+    struct key_spec key;
+    int compress;
+    int compress_level;
+    int stdin_mode;
+    size_t retries;
+    struct timeval backoff_min;
+    struct timeval backoff_max;
+    size_t compress_threads;
+    int prefault;
+    struct timeval stats_interval;
+    int adaptive;
+    size_t adaptive_min;
+    size_t adaptive_max;
+    size_t overhead;    // percent
+    struct timeval grace;
+    const char **inputs; // paths, or NULL for stdin
+    size_t nb_inputs;
+    int auto_jobs;      // -j auto
+    struct placement placement;
+};
+
+// How chunks are passed to commands.
+enum
+{
+    stdin_pipe,     // written to a pipe
+    stdin_memfd,    // written to a sealed memory file
+};
+
+// Compression of chunks.
+enum
+{
+    compress_none,
+    compress_gzip,
+    compress_zstd,
+    compress_lz4,
+};
+
+// Distribution of chunks among persistent workers.
+enum
+{
+    balance_round_robin,    // workers take turns
+    balance_least_loaded,   // idle worker with the least data in its pipe
+};
+
+// Batch framing used in persistent mode.
+enum
+{
+    frame_nul,      // NUL byte after each batch
+    frame_u32be,    // 32-bit big-endian length before each batch
+    frame_record,   // delimiter record after each batch
+};
+
+// span is a piece of data to be written.
+struct span
+{
+    const char *data;
+    size_t size;
+};
+
+// chunk is a range of the input buffer queued for a command. The range stays
+// reserved until the chunk and all preceding ones have been written.
+struct chunk
+{
+    const char *data;
+    size_t size;
+    int written;
+    char *buffer;       // storage owned by the chunk, or NULL if in the ring
+    size_t capacity;    // capacity of buffer from the pool
+    int mapped;         // data is a mapping of a spill file
+    int in_mapping;     // data is in the mapping of the input file
+    char *key;          // key of the lines, or NULL
+    uintmax_t offset;   // bytes queued before the chunk
+    size_t input_size;  // size before compression
+    size_t records;     // number of records, unless in persistent mode
+    size_t attempts;    // failed commands for the chunk
+    int waiting;        // to be sent again at retry_at
+    struct timeval retry_at;
+};
+
+// spill is a line too long for the input buffer, moved to an unlinked
+// temporary file as it arrives.
+struct spill
+{
+    int fd;             // -1 if no line is being spilled
+    size_t size;
+    size_t need;        // bytes left of a length-prefixed record
+};
+
+// mapping is a regular input file mapped into memory as a whole, so that
+// chunks are cut from it in place instead of being read.
+struct mapping
+{
+    char *base;         // page-aligned start of the mapping
+    size_t length;
+    size_t offset;      // offset of the data at the file position of the input
+    off_t start;        // file offset of base
+    size_t sent;        // size of the data queued as chunks
+};
+
+// line_scan tracks complete lines at the head of the input buffer.
+struct line_scan
+{
+    size_t scanned;     // bytes searched for newlines
+    size_t size;        // size of the complete lines
+    size_t count;       // number of the complete lines if counted
+};
+
+// job is a command process started for a chunk.
+struct job
+{
+    int active;
+    pid_t pid;          // 0 after the process is reaped
+    int in_fd;          // write end of the stdin pipe or -1
+    int out_fd;         // read end of the captured stdout or -1
+    uintmax_t seq;      // sequence number of the chunk
+    char *out;          // captured output waiting for preceding chunks
+    size_t out_size;
+    size_t out_capacity; // capacity of out from the pool
+    struct line_scan out_scan; // complete records in out with --collect
+    size_t out_need;    // bytes left of a long length-prefixed record
+    int failed;         // exited with failure and the chunk is to be retried
+    struct timeval started;
+    size_t size;        // size of the chunk
+
+    // Input being written to the non-blocking stdin: frame header, chunk and
+    // frame trailer. input_count is zero while no chunk is being written.
+    struct span input[4];
+    size_t input_index;
+    size_t input_count;
+    size_t splice_span; // index of the chunk in input
+    size_t splice_size; // bytes of the chunk that may be spliced
+    uintmax_t input_seq; // sequence number of the chunk in the queue
+    unsigned char header[4];
+};
+
+// Events of descriptors watched by the event loop.
+enum
+{
+    ev_read  = 1,
+    ev_write = 2,
+};
+
+// watch is the state of a descriptor in the event loop.
+struct watch
+{
+    unsigned char wanted;   // events to watch in the next wait
+    unsigned char watched;  // events registered to the kernel
+    unsigned char ready;    // events found ready in the last wait
+    unsigned char always;   // descriptor cannot be polled and is always ready
+};
+
+// loop is an event loop on epoll, kqueue or poll(). Descriptors to watch are
+// declared with watch_fd() before each wait_loop(), and only changes of the
+// interest are passed to the kernel. A descriptor must be removed with
+// forget_fd() before it is closed, since the number may be reused.
+struct loop
+{
+    int fd;                 // epoll or kqueue instance, or -1 for poll()
+    struct watch *watches;  // indexed by descriptor
+    size_t capacity;
+#if defined(HAVE_EPOLL)
+    struct epoll_event *events;
+#elif defined(HAVE_KQUEUE)
+    struct kevent *events;  // two filters for each descriptor
+#else
+    struct pollfd *events;
+#endif
+};
+
+// pool keeps buffers for chunks, batches and captured outputs in size classes
+// of powers of two. Buffers from pool_min are mapped directly, advised to use
+// huge pages, and kept for reuse when freed while the buffers taken and kept
+// fit in limit bytes, so that the pages are not faulted in again for each
+// chunk. Smaller buffers come from malloc().
+struct pool
+{
+    char *free[CHAR_BIT * sizeof(size_t)]; // linked through the first bytes
+    size_t used;        // size of the buffers taken
+    size_t cached;      // size of the free buffers
+    size_t limit;
+};
+
+// Smallest size class and the smallest pooled buffer.
+enum
+{
+    pool_class_min = 256,
+    pool_min = 64 * 1024,
+};
+
+// task is a chunk to be compressed by a compressor thread.
+struct task
+{
+    const char *data;
+    size_t size;
+    char *out;          // buffer for the compressed data
+    size_t out_cap;
+    size_t out_size;
+    int result;
+};
+
+// compressor is a thread compressing chunks. Tasks are passed through a
+// single-producer single-consumer ring: the main thread fills the slot at tail
+// and advances tail, and the compressor advances done after each task. Each
+// index is written by one thread only and read by the other with acquire
+// semantics, so the ring needs no lock. An idle compressor sleeps on the wake
+// pipe.
+struct compressor
+{
+    pthread_t thread;
+    struct task tasks[16];
+    size_t tail;        // written by the main thread
+    size_t done;        // written by the compressor
+    size_t collected;   // results taken by the main thread
+    int wake[2];
+    int notify_fd;      // written after each task
+    int method;
+    int level;
+};
+
+// histogram counts samples in buckets of powers of two. Bucket i holds values
+// up to 2^i that do not fit in bucket i - 1.
+struct histogram
+{
+    uintmax_t buckets[48];
+    uintmax_t count;
+    uintmax_t sum;
+};
+
+// Reasons for sending a chunk.
+enum
+{
+    flush_full,     // buffer full
+    flush_size,     // -s reached
+    flush_count,    // -n reached
+    flush_timeout,  // -t elapsed
+    flush_delay,    // --max-delay elapsed
+    flush_idle,     // --idle elapsed
+    flush_mem,      // --mem ran out with batches by key
+    flush_spill,    // record longer than the buffer
+    flush_eof,      // end of input
+    flush_hangup,   // SIGHUP
+    nb_flush_reasons,
+};
+
+// stats collects counters of chunks and commands, reported on SIGUSR1 and
+// every --stats-interval. Durations are in microseconds.
+struct stats
+{
+    uintmax_t bytes_in;     // read from stdin
+    uintmax_t bytes_out;    // written to commands, including frames
+    uintmax_t flushes[nb_flush_reasons];
+    struct histogram chunk_bytes;
+    struct histogram chunk_records;
+    struct histogram carry_bytes;   // partial record left after a chunk
+    struct histogram spawn_us;      // until a command is executed
+    struct histogram run_us;        // from start to exit of a command
+    struct histogram input_wait_us; // waiting for stdin
+    struct histogram job_wait_us;   // waiting for commands only
+    struct histogram output_us;     // writing captured output to stdout
+    int count_records;  // records are counted even if -n is not given
+    struct timeval interval;
+    struct timeval next_report;
+};
+
+// adaptive tunes the chunk size and the number of concurrent commands from
+// the run time of commands. The run time is modeled as a fixed cost per
+// command plus a cost per byte, fitted by least squares with exponentially
+// decaying weights. The chunk size is chosen for the fixed cost to take the
+// target fraction of the run time. Until the model is fitted, the size
+// doubles after each command from min. The number of concurrent commands
+// grows by one per window of commands and halves when a command takes twice
+// the time predicted, like the congestion window of TCP.
+struct adaptive
+{
+    int enabled;
+    size_t min;
+    size_t max;
+    double overhead;    // target fraction of the fixed cost
+    size_t size;        // current chunk size
+    double window;      // allowed concurrent commands
+    int fitted;
+    double fixed;       // microseconds
+    double per_byte;    // microseconds
+    double weight;      // decayed sums of samples
+    double sum_x;
+    double sum_y;
+    double sum_xx;
+    double sum_xy;
+};
+
+// jobs tracks command processes running in background and the queue of chunks
+// to be written to them.
+struct jobs
+{
+    struct loop loop;
+    const struct command *command;
+    struct ring *ring;
+    struct pool pool;
+    struct job *slots;
+    size_t capacity;
+    size_t running;     // number of active slots
+    int status;         // first non-zero exit status
+    int keep_order;
+    int collect;        // outputs are written in whole records
+    const struct record_spec *record;
+    struct job *out_owner; // command writing a record longer than the buffer
+    int persistent;
+    int balance;
+    int frame;
+    const char *frame_record;
+    int compress;
+    int compress_level;
+    int stdin_mode;
+    size_t retries;     // commands started again for a failed chunk
+    struct timeval backoff_min;
+    struct timeval backoff_max;
+    size_t nb_waiting;  // chunks waiting for retry
+
+    // Compressor threads, which take chunks in turn. The last nb_compressing
+    // chunks in the queue are being compressed; results are collected in
+    // queue order.
+    struct compressor *compressors;
+    size_t nb_compressors;
+    size_t nb_compressing;
+    uintmax_t next_task;
+    uintmax_t next_result;
+    int compress_notify[2];
+    size_t next_worker; // slot to send the next batch in persistent mode
+    size_t out_cap;     // capacity of each captured output buffer
+    uintmax_t out_seq;  // sequence number of the chunk to output next
+    uintmax_t offset;   // bytes queued as chunks
+    char **env;         // environment with slots for XPIPE_* at env_base
+    size_t env_base;
+    const char *error;  // description of the last failed operation
+
+    // Input stops on SIGTERM or SIGINT, and commands are killed if they do
+    // not finish by the deadline after the grace period.
+    const struct placement *placement;
+    int draining;
+    struct timeval grace;
+    struct timeval grace_deadline;
+    int has_grace_deadline;
+
+    // Chunks not yet written, oldest first. With retries, chunks are kept
+    // until their commands succeed. The last chunk_pending ones have
+    // not been assigned to commands.
+    struct chunk *chunks;
+    size_t chunk_cap;
+    size_t chunk_first;
+    size_t chunk_count;
+    size_t chunk_pending;
+    uintmax_t chunk_seq; // sequence number of the oldest chunk
+
+    struct stats stats;
+    struct adaptive adaptive;
+};
+
+// shard is a batch of lines sharing a key. A shard exists while it has lines
+// and is removed when sent.
+struct shard
+{
+    char *key;          // NUL-terminated
+    size_t key_size;
+    size_t hash;
+    char *buf;
+    size_t size;
+    size_t capacity;
+    size_t lines;
+    struct timeval first;   // arrival of the first line
+    struct shard *chain;    // next shard in the same bucket
+    struct shard *prev;     // neighbors in order of the first arrival
+    struct shard *next;
+};
+
+// shards is a hash table of shards, also linked in order of the first arrival
+// so that the oldest batch is found without scanning.
+struct shards
+{
+    struct shard **buckets;
+    size_t nb_buckets;
+    size_t count;
+    size_t size;        // total size of buffered lines
+    struct shard *oldest;
+    struct shard *newest;
+};
+
+// ring is a buffer holding input data at head. Free space follows the data
+// contiguously. If mirrored, the storage is mapped twice back to back so that
+// data wraps around without moving, and consumed data stays pinned before
+// head until released; otherwise data is moved to the front of the buffer on
+// consumption.
+struct ring
+{
+    char *base;
+    size_t capacity;
+    size_t head;
+    size_t size;
+    size_t pinned;      // consumed bytes before head not released yet
+    int mirrored;
+};
+
+// source is an input read concurrently with others. Its data is buffered and
+// complete records are passed to the input buffer, so that records of
+// different sources do not mix.
+struct source
+{
+    int fd;             // -1 after end of input
+    int listening;      // socket accepting connections as sources
+    const char *name;
+    char *buf;          // NULL for the only source, read directly
+    size_t size;
+    size_t capacity;    // excluding room for a delimiter added at the end
+    struct line_scan scan;
+};
+
+// inputs is the set of sources. A record too long to be passed at once is
+// passed in pieces by its source, the owner, and only the owner is read until
+// the record ends.
+struct inputs
+{
+    struct source **sources;
+    size_t count;
+    size_t capacity;
+    size_t next;        // source to pass records from next
+    struct source *owner;
+    size_t need;        // bytes left of the length-prefixed record of the owner
+    char *tail;         // end of the record of the owner passed so far
+    size_t tail_size;
+    size_t buf_size;
+    const struct record_spec *spec;
+};
+
+// arrivals records when buffered input arrived. Each entry holds the stream
+// offset of the first byte of a read and the time of the read. The queue is
+// bounded; when it is full, the second oldest entry is merged into the oldest
+// one, which makes data look older than it is but never younger.
+struct arrivals
+{
+    size_t count;
+    struct {
+        uintmax_t offset;
+        struct timeval time;
+    } entries[32];
+};
+
+// Values of long options without short equivalent.
+enum
+{
+    opt_batch_frame = 256,
+    opt_max_delay,
+    opt_idle,
+    opt_mem,
+    opt_key,
+    opt_balance,
+    opt_compress,
+    opt_compress_threads,
+    opt_stdin,
+    opt_retry,
+    opt_backoff,
+    opt_prefault,
+    opt_framing,
+    opt_stats_interval,
+    opt_adaptive,
+    opt_overhead,
+    opt_grace,
+    opt_cpus,
+    opt_nice,
+    opt_ionice,
 };
 
 static void    usage(void);
 static int     configure(struct config *config, int argc, char **argv);
 static int     run(const struct config *config);
-static int     do_run(const struct config *config, char *buf);
-static ssize_t pipe_lines(char **argv, const char *buf, size_t size, int *status);
-static int     pipe_data(char **argv, const char *buf, size_t size, int *status);
-static pid_t   open_pipe(char **argv, int *fd);
+static int     do_run(const struct config *config, struct ring *ring, struct jobs *jobs, struct shards *shards, struct inputs *inputs);
+static int     open_inputs(struct inputs *inputs, const struct config *config);
+static void    free_inputs(struct inputs *inputs);
+static int     add_source(struct inputs *inputs, int fd, const char *name, int listening);
+static void    remove_source(struct inputs *inputs, size_t index);
+static int     open_listener(const char *spec);
+static ssize_t read_inputs(struct jobs *jobs, struct inputs *inputs, char *buf, size_t size, const struct timeval *deadline);
+static int     fill_source(struct jobs *jobs, struct inputs *inputs, size_t index);
+static void    end_source(struct jobs *jobs, struct inputs *inputs, struct source *source);
+static size_t  take_input(struct inputs *inputs, char *buf, size_t size);
+static size_t  pass_owner(struct inputs *inputs, char *buf, size_t size);
+static ssize_t spill_record(struct ring *ring, struct spill *spill, const struct record_spec *spec, int *complete);
+static int     spill_input(struct ring *ring, struct spill *spill, size_t size);
+static int     pipe_spill(struct jobs *jobs, const struct config *config, struct spill *spill);
+static int     open_spill(void);
+static void    scan_lines(struct line_scan *scan, const struct record_spec *spec, const char *buf, size_t size, size_t max_count);
+static ssize_t end_of_record(const struct record_spec *spec, const char *buf, size_t size, size_t start, size_t scanned);
+static const char *record_payload(const struct record_spec *spec, const char *record, size_t size, size_t *payload_size);
+static size_t  count_records(const struct record_spec *spec, const char *buf, size_t size);
+static size_t  chunk_limit(const struct config *config, const struct jobs *jobs);
+static size_t  memory_used(const struct jobs *jobs);
+static void    adapt_chunks(struct adaptive *adaptive, size_t size, uintmax_t run_us, size_t capacity);
+static ssize_t pipe_lines(struct jobs *jobs, size_t size);
+static int     pipe_data(struct jobs *jobs, size_t size);
+static int     map_input(struct inputs *inputs, struct mapping *mapping);
+static int     pipe_mapped(const struct config *config, struct jobs *jobs, struct mapping *mapping);
+static size_t  plan_chunk(const struct config *config, const char *buf, size_t size, size_t limit);
+static struct chunk *queue_chunk(struct jobs *jobs, const char *buf, size_t size);
+static int     start_jobs(struct jobs *jobs);
+static int     start_chunk(struct jobs *jobs, struct job *job, uintmax_t seq);
+static void    coalesce_chunks(struct jobs *jobs, uintmax_t seq);
+static int     start_retries(struct jobs *jobs);
+static int     retry_chunk(struct jobs *jobs, struct job *job);
+static int     next_retry(const struct jobs *jobs, struct timeval *deadline);
+static int     start_workers(struct jobs *jobs);
+static int     pick_worker(struct jobs *jobs, struct job **worker);
+static size_t  pipe_load(int fd);
+static int     spawn_job(struct jobs *jobs, struct job *job, int capture, uintmax_t seq, int in_file);
+static int     spawn_file_job(struct jobs *jobs, struct job *job, uintmax_t seq);
+static void    start_input(struct jobs *jobs, struct job *job, uintmax_t seq);
+static int     feed_job(struct jobs *jobs, struct job *job);
+static void    drop_input(struct jobs *jobs, struct job *job);
+static void    release_chunks(struct jobs *jobs);
+static struct chunk *chunk_at(struct jobs *jobs, uintmax_t seq);
+static void    free_chunk(struct jobs *jobs, struct chunk *chunk);
+static int     compress_chunk(struct jobs *jobs, struct chunk *chunk);
+static int     compress_queued(struct jobs *jobs, struct chunk *chunk);
+static void    replace_data(struct jobs *jobs, struct chunk *chunk, char *out, size_t out_cap, size_t out_size);
+static int     start_compressors(struct jobs *jobs, size_t count);
+static void    stop_compressors(struct jobs *jobs);
+static void   *run_compressor(void *arg);
+static int     submit_chunk(struct jobs *jobs, struct chunk *chunk);
+static int     collect_chunks(struct jobs *jobs);
+static size_t  compress_bound(int method, int level, size_t size);
+static int     compress_data(int method, int level, const char *buf, size_t size, char *out, size_t out_cap, size_t *out_size);
+static int     route_lines(struct jobs *jobs, struct shards *shards, const struct config *config, const char *buf, size_t size, const struct timeval *now);
+static int     send_shard(struct jobs *jobs, struct shards *shards, struct shard *shard, int reason);
+static int     send_overdue(struct jobs *jobs, struct shards *shards, const struct timeval *delay, const struct timeval *now, int reason);
+static int     send_shards(struct jobs *jobs, struct shards *shards, int reason);
+static const char *extract_key(const struct key_spec *spec, const char *line, size_t size, size_t *key_size);
+static size_t  hash_key(const char *key, size_t size);
+static int     init_shards(struct shards *shards);
+static void    free_shards(struct shards *shards, struct pool *pool);
+static struct shard *get_shard(struct shards *shards, const char *key, size_t key_size, const struct timeval *now);
+static int     grow_shards(struct shards *shards);
+static void    remove_shard(struct shards *shards, struct shard *shard);
+static int     append_line(struct shard *shard, struct pool *pool, const char *line, size_t size);
+static int     parse_template(struct command *command);
+static char  **expand_args(const struct command *command, const char *const *values);
+static void    free_args(const struct command *command, char **args);
+static char  **chunk_env(struct jobs *jobs);
+static size_t  available_cpus(const struct placement *placement);
+static size_t  cgroup_cpus(void);
+static size_t  read_quota(const char *root, const char *path, int v2);
+static int     start_placement(const struct placement *placement);
+static int     end_placement(const struct placement *placement, pid_t pid);
+static pid_t   open_pipe(const struct command *command, char **env, int in_file, int *fd, int *out_fd);
+static char   *find_program(const char *name);
 static int     write_all(int fd, const char *buf, size_t size);
-static ssize_t try_read(int fd, char *buf, size_t size, const struct timeval *deadline);
-static int     wait_input(int fd, const struct timeval *deadline);
+static int     write_output(struct jobs *jobs, const char *buf, size_t size);
+static int     write_vector(struct jobs *jobs, struct iovec *iov, size_t count);
+static ssize_t splice_some(int fd, const char *buf, size_t size);
+static ssize_t try_read(struct jobs *jobs, int fd, char *buf, size_t size, const struct timeval *deadline);
+static int     wait_input(struct jobs *jobs, int fd, const struct timeval *deadline);
+static int     wait_io(struct jobs *jobs, int rfd, const struct timeval *deadline);
+static int     wait_fds(struct jobs *jobs, const int *rfds, size_t nb_rfds, const struct timeval *deadline);
+static int     drain_chunks(struct jobs *jobs);
+static int     finish_jobs(struct jobs *jobs);
+static int     wait_jobs(struct jobs *jobs, size_t max_running);
+static int     wait_grace(struct jobs *jobs);
+static int     begin_drain(struct jobs *jobs, struct inputs *inputs);
+static int     reap_jobs(struct jobs *jobs);
+static int     read_output(struct jobs *jobs, struct job *job);
+static int     flush_outputs(struct jobs *jobs);
+static size_t  output_ready(struct jobs *jobs, struct job *job);
+static void    release_output(struct jobs *jobs, struct job *job);
+static int     settle_jobs(struct jobs *jobs);
+static struct job *free_slot(struct jobs *jobs);
+static void    add_job(struct jobs *jobs, struct job *job, pid_t pid, int in_fd, int out_fd);
+static int     close_inputs(struct jobs *jobs);
+static void    finish_job(struct jobs *jobs, pid_t pid, int status);
+static int     fail(struct jobs *jobs, const char *error);
+static void    report_error(const struct jobs *jobs, const char *fallback);
+static void    note_chunk(struct stats *stats, int reason, size_t size, size_t records);
+static void    add_sample(struct histogram *histogram, uintmax_t value);
+static uintmax_t elapsed_us(const struct timeval *start, const struct timeval *end);
+static int     report_stats(struct stats *stats, const struct timeval *now);
+static void    format_histogram(char *line, size_t *length, size_t capacity, const char *name, const struct histogram *histogram);
+static void    append_format(char *line, size_t *length, size_t capacity, const char *format, ...);
+static int     setup_sigchld(void);
+static int     setup_sigusr1(void);
+static int     setup_drain(void);
+static int     ignore_sigpipe(void);
+static void    handle_sigchld(int sig);
+static void    handle_sigusr1(int sig);
+static void    handle_drain(int sig);
+static void    handle_sighup(int sig);
+static void    close_job_fd(struct jobs *jobs, int *fd);
+static int     init_loop(struct loop *loop);
+static void    free_loop(struct loop *loop);
+static int     grow_loop(struct loop *loop, size_t capacity);
+static int     watch_fd(struct loop *loop, int fd, int events);
+static void    forget_fd(struct loop *loop, int fd);
+static int     update_fd(struct loop *loop, int fd, int events);
+static int     wait_loop(struct loop *loop, const struct timeval *deadline);
+static int     ready_events(const struct loop *loop, int fd);
+static int     set_nonblock(int fd);
+static int     set_block(int fd);
+static int     set_cloexec(int fd);
 static void    close_or_exit(int fd, int status);
+static int     init_ring(struct ring *ring, size_t capacity);
+static int     map_mirror(struct ring *ring, size_t capacity);
+static int     open_shared_memory(void);
+static int     open_chunk_file(void);
+static int     seal_file(int fd);
+static void    free_ring(struct ring *ring);
+static void    consume_ring(struct ring *ring, size_t size);
+static void    discard_ring(struct ring *ring, size_t size);
+static void    release_ring(struct ring *ring, size_t size);
+static size_t  ring_space(const struct ring *ring);
+static void    prefault_ring(struct ring *ring);
+static char   *get_buffer(struct pool *pool, size_t size, size_t *capacity);
+static void    put_buffer(struct pool *pool, char *buf, size_t capacity);
+static void    trim_pool(struct pool *pool, size_t limit);
+static void    free_pool(struct pool *pool);
+static void    advise_hugepages(void *addr, size_t size);
 static int     monoclock(struct timeval *time);
+static void    add(const struct timeval *t1, const struct timeval *t2, struct timeval *sum);
 static void    sub(const struct timeval *t1, const struct timeval *t2, struct timeval *diff);
+static int     is_positive(const struct timeval *time);
+static int     earlier(const struct timeval *t1, const struct timeval *t2);
+static void    pick_deadline(struct timeval *deadline, int *has_deadline, const struct timeval *candidate);
+static void    record_arrival(struct arrivals *arrivals, uintmax_t offset, const struct timeval *time);
+static void    forget_arrivals(struct arrivals *arrivals, uintmax_t head, uintmax_t tail);
 static void    normalize(struct timeval *time);
 static int     parse_size(const char *str, size_t *value);
-static int     parse_duration(const char *str, time_t *value);
+static int     parse_duration(const char *str, struct timeval *value);
+static int     parse_frame(const char *str, struct config *config);
+static int     parse_key(const char *str, struct key_spec *key);
+static int     parse_balance(const char *str, int *balance);
+static int     parse_compress(const char *str, struct config *config);
+static int     parse_stdin(const char *str, int *mode);
+static int     parse_backoff(const char *str, struct timeval *min, struct timeval *max);
+static int     parse_size_range(const char *str, size_t *min, size_t *max);
 static int     parse_uint(const char *str, uintmax_t *value, uintmax_t limit);
 static ssize_t find_last(const char *buf, size_t size, char ch);
+static const char *find_bytes(const char *buf, size_t size, const char *pattern, size_t pattern_size);
+static int     parse_delim(const char *str, struct record_spec *record);
+#if defined(HAVE_SCHED_AFFINITY)
+static int     parse_cpus(const char *str, struct placement *placement);
+#endif
+#if defined(HAVE_IOPRIO)
+static int     parse_ionice(const char *str, struct placement *placement);
+#endif
 
-enum
-{
-    exit_panic = 255,
-};
+// sigchld_pipe is the self-pipe notified by the SIGCHLD handler. The read end
+// is watched along with the input so that exited children are reaped without
+// blocking the main loop.
+static int sigchld_pipe[2] = {-1, -1};
+static volatile sig_atomic_t stats_requested = 0;
+static volatile sig_atomic_t drain_requested = 0;   // signals received
+static volatile sig_atomic_t drain_signal = 0;
+static volatile sig_atomic_t flush_requested = 0;
+
+extern char **environ;
 
 int main(int argc, char **argv)
 {
     struct config config = {
         .buf_size = 8192,
-        .argv     = NULL,
-        .timeout  = 0,
+        .batch_size  = 0,
+        .batch_lines = 0,
+        .command  = { NULL, NULL, NULL, 0 },
+        .record   = { record_delim, NULL, 0 },
+        .timeout  = { 0, 0 },
+        .max_delay = { 0, 0 },
+        .idle     = { 0, 0 },
+        .jobs     = 1,
+        .mem      = 0,
+        .keep_order = 0,
+        .collect    = 0,
+        .persistent = 0,
+        .balance    = balance_round_robin,
+        .frame      = frame_nul,
+        .frame_record = NULL,
+        .key        = { key_none, '\t', 0, 0 },
+        .compress   = compress_none,
+        .compress_level = 0,
+        .stdin_mode = stdin_pipe,
+        .retries    = 0,
+        .backoff_min = { 0, 100000 },
+        .backoff_max = { 10, 0 },
+        .compress_threads = 0,
+        .prefault   = 0,
+        .stats_interval = { 0, 0 },
+        .adaptive   = 0,
+        .adaptive_min = 0,
+        .adaptive_max = 0,
+        .overhead   = 10,
+        .grace      = { 0, 0 },
+        .inputs     = NULL,
+        .nb_inputs  = 0,
+        .auto_jobs  = 0,
+        .placement  = { .has_cpus = 0, .has_nice = 0, .nice = 0, .ioprio = -1 },
     };
     if (configure(&config, argc, argv) == -1) {
         return 1;
@@ -68,364 +897,5785 @@ int main(int argc, char **argv)
 void usage(void)
 {
     const char *msg =
-        "Usage: xpipe [-h] [-b bufsize] [-t timeout] command ...\n"
+        "Usage: xpipe [-0chkP] [-b bufsize] [-s size] [-n lines] [-t timeout] [-j jobs]\n"
+        "             [-d delim] [-i input ...] command ...\n"
         "\n"
         "Options\n"
         "  -b bufsize  set buffer size in bytes\n"
-        "  -t timeout  set buffer timeout in seconds\n"
+        "  -i input    read input from a file or FIFO, unix:PATH or tcp:[HOST:]PORT\n"
+        "              socket, or stdin (-); may be repeated\n"
+        "  -d delim    end records with delim instead of newline (e.g. '\\0' or '\\r\\n')\n"
+        "  -0          end records with NUL (same as -d '\\0')\n"
+        "  --framing=u32be\n"
+        "              read records prefixed with 32-bit big-endian length\n"
+        "  -s size     send chunks of up to this size in bytes (default: bufsize)\n"
+        "  -n lines    send chunks of up to this number of lines\n"
+        "  -t timeout  set buffer timeout in seconds or with unit (e.g. 50ms)\n"
+        "  --max-delay=duration\n"
+        "              send lines no later than this after the oldest one arrived\n"
+        "  --idle=duration\n"
+        "              send lines after input is idle for this duration\n"
+        "  -j jobs     run up to this number of commands concurrently, or one per\n"
+        "              CPU available in the cgroup with -j auto\n"
+        "  --mem=size  buffer up to this size in bytes in total\n"
+        "              (default: bufsize * (jobs + 1), and bufsize more per\n"
+        "              job with -k or -c)\n"
+        "  --prefault  fault in the input buffer in advance\n"
+        "  -k          write outputs of commands in input order (--keep-order)\n"
+        "  -c          write outputs of commands in whole records (--collect)\n"
+        "  -P          send all chunks to persistent commands (--persistent)\n"
+        "  --balance=round-robin|least-loaded\n"
+        "              set how chunks are distributed to persistent commands\n"
+        "              (implies -P)\n"
+        "  --batch-frame=nul|u32be|record:TEXT\n"
+        "              set how chunks are delimited in persistent mode\n"
+        "  --compress=gzip|zstd|lz4[:level]\n"
+        "              compress each chunk before sending it\n"
+        "  --compress-threads=N\n"
+        "              compress chunks in N threads besides the main thread\n"
+        "  --key=N[:C]|bM-N\n"
+        "              batch lines separately by field N delimited by C (default:\n"
+        "              tab) or bytes M to N, and substitute the key for {}\n"
+        "  --stdin=pipe|memfd\n"
+        "              pass each chunk through a pipe or a sealed memory file,\n"
+        "              whose path is substituted for {file}\n"
+        "  --retry=N   start a command again up to N times for a failed chunk\n"
+        "  --backoff=min[..max]\n"
+        "              set the delay before a retry, doubled each time\n"
+        "              (default: 100ms..10s)\n"
+        "  --stats-interval=duration\n"
+        "              report statistics to stderr periodically (also on SIGUSR1)\n"
+        "  --adaptive[=min..max]\n"
+        "              size chunks from the run time of commands (default:\n"
+        "              4K..size) and adjust the number of concurrent commands\n"
+        "  --overhead=percent\n"
+        "              set the target share of the fixed cost of a command with\n"
+        "              --adaptive (default: 10)\n"
+        "  --grace=duration\n"
+        "              wait this long for commands after SIGTERM or SIGINT\n"
+        "              before killing them (default: no limit)\n"
+        "  --cpus=list run commands on these CPUs (e.g. 0-3,6)\n"
+        "  --nice=N    run commands with nice value increased by N\n"
+        "  --ionice=idle|best-effort[:level]\n"
+        "              set the I/O scheduling class of commands\n"
         "  -h          show this help\n"
         "\n";
     fputs(msg, stderr);
 }
 
-// configure sets xpipe parameters to user-supplied values.
+// configure sets xpipe parameters to user-supplied values.
+//
+// Returns 0 on success or -1 on error.
+int configure(struct config *config, int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "keep-order",  no_argument,       NULL, 'k' },
+        { "collect",     no_argument,       NULL, 'c' },
+        { "persistent",  no_argument,       NULL, 'P' },
+        { "balance",     required_argument, NULL, opt_balance },
+        { "batch-frame", required_argument, NULL, opt_batch_frame },
+        { "max-delay",   required_argument, NULL, opt_max_delay },
+        { "idle",        required_argument, NULL, opt_idle },
+        { "mem",         required_argument, NULL, opt_mem },
+        { "key",         required_argument, NULL, opt_key },
+        { "compress",    required_argument, NULL, opt_compress },
+        { "compress-threads", required_argument, NULL, opt_compress_threads },
+        { "stdin",       required_argument, NULL, opt_stdin },
+        { "retry",       required_argument, NULL, opt_retry },
+        { "backoff",     required_argument, NULL, opt_backoff },
+        { "prefault",    no_argument,       NULL, opt_prefault },
+        { "framing",     required_argument, NULL, opt_framing },
+        { "stats-interval", required_argument, NULL, opt_stats_interval },
+        { "adaptive",    optional_argument, NULL, opt_adaptive },
+        { "overhead",    required_argument, NULL, opt_overhead },
+        { "grace",       required_argument, NULL, opt_grace },
+        { "cpus",        required_argument, NULL, opt_cpus },
+        { "nice",        required_argument, NULL, opt_nice },
+        { "ionice",      required_argument, NULL, opt_ionice },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL,          0,                 NULL, 0   },
+    };
+
+    for (int ch; (ch = getopt_long(argc, argv, "+b:s:n:t:j:d:0i:kcPh", long_options, NULL)) != -1; ) {
+        switch (ch) {
+          case 'b':
+            if (parse_size(optarg, &config->buf_size) == -1) {
+                fputs("xpipe: invalid buffer size\n", stderr);
+                return -1;
+            }
+            break;
+
+          case 's':
+            if (parse_size(optarg, &config->batch_size) == -1 || config->batch_size == 0) {
+                fputs("xpipe: invalid chunk size\n", stderr);
+                return -1;
+            }
+            break;
+
+          case 'n':
+            if (parse_size(optarg, &config->batch_lines) == -1 || config->batch_lines == 0) {
+                fputs("xpipe: invalid number of lines\n", stderr);
+                return -1;
+            }
+            break;
+
+          case 't':
+            if (parse_duration(optarg, &config->timeout) == -1) {
+                fputs("xpipe: invalid timeout\n", stderr);
+                return -1;
+            }
+            break;
+
+          case 'j':
+            config->auto_jobs = strcmp(optarg, "auto") == 0;
+            if (config->auto_jobs) {
+                break;
+            }
+            if (parse_size(optarg, &config->jobs) == -1 || config->jobs == 0) {
+                fputs("xpipe: invalid number of jobs\n", stderr);
+                return -1;
+            }
+            break;
+
+          case 'd':
+            if (parse_delim(optarg, &config->record) == -1) {
+                fputs("xpipe: invalid delimiter\n", stderr);
+                return -1;
+            }
+            break;
+
+          case '0':
+            if (parse_delim("\\0", &config->record) == -1) {
+                fputs("xpipe: invalid delimiter\n", stderr);
+                return -1;
+            }
+            break;
+
+          case 'i': {
+            const char **inputs = realloc(config->inputs, (config->nb_inputs + 1) * sizeof *inputs);
+            if (inputs == NULL) {
+                perror("xpipe: failed to allocate memory");
+                return -1;
+            }
+            inputs[config->nb_inputs++] = optarg;
+            config->inputs = inputs;
+            break;
+          }
+
+          case opt_framing:
+            if (strcmp(optarg, "u32be") != 0) {
+                fputs("xpipe: invalid framing\n", stderr);
+                return -1;
+            }
+            config->record.type = record_u32be;
+            break;
+
+          case 'k':
+            config->keep_order = 1;
+            break;
+
+          case 'c':
+            config->collect = 1;
+            break;
+
+          case 'P':
+            config->persistent = 1;
+            break;
+
+          case opt_balance:
+            if (parse_balance(optarg, &config->balance) == -1) {
+                fputs("xpipe: invalid balance\n", stderr);
+                return -1;
+            }
+            config->persistent = 1;
+            break;
+
+          case opt_batch_frame:
+            if (parse_frame(optarg, config) == -1) {
+                fputs("xpipe: invalid batch frame\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_max_delay:
+            if (parse_duration(optarg, &config->max_delay) == -1) {
+                fputs("xpipe: invalid max delay\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_idle:
+            if (parse_duration(optarg, &config->idle) == -1) {
+                fputs("xpipe: invalid idle duration\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_mem:
+            if (parse_size(optarg, &config->mem) == -1 || config->mem == 0) {
+                fputs("xpipe: invalid memory size\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_key:
+            if (parse_key(optarg, &config->key) == -1) {
+                fputs("xpipe: invalid key\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_compress:
+            if (parse_compress(optarg, config) == -1) {
+                return -1;
+            }
+            break;
+
+          case opt_compress_threads:
+            if (parse_size(optarg, &config->compress_threads) == -1) {
+                fputs("xpipe: invalid number of threads\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_stdin:
+            if (parse_stdin(optarg, &config->stdin_mode) == -1) {
+                fputs("xpipe: invalid stdin mode\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_retry:
+            if (parse_size(optarg, &config->retries) == -1) {
+                fputs("xpipe: invalid number of retries\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_backoff:
+            if (parse_backoff(optarg, &config->backoff_min, &config->backoff_max) == -1) {
+                fputs("xpipe: invalid backoff\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_prefault:
+            config->prefault = 1;
+            break;
+
+          case opt_stats_interval:
+            if (parse_duration(optarg, &config->stats_interval) == -1) {
+                fputs("xpipe: invalid stats interval\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_adaptive:
+            config->adaptive = 1;
+            if (optarg &&
+                parse_size_range(optarg, &config->adaptive_min, &config->adaptive_max) == -1) {
+                fputs("xpipe: invalid adaptive chunk size\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_overhead:
+            if (parse_size(optarg, &config->overhead) == -1 || config->overhead == 0 ||
+                config->overhead >= 100) {
+                fputs("xpipe: invalid overhead\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_grace:
+            if (parse_duration(optarg, &config->grace) == -1) {
+                fputs("xpipe: invalid grace period\n", stderr);
+                return -1;
+            }
+            break;
+
+          case opt_cpus:
+#if defined(HAVE_SCHED_AFFINITY)
+            if (parse_cpus(optarg, &config->placement) == -1) {
+                fputs("xpipe: invalid CPU list\n", stderr);
+                return -1;
+            }
+            break;
+#else
+            fputs("xpipe: --cpus is not supported on this platform\n", stderr);
+            return -1;
+#endif
+
+          case opt_nice: {
+            uintmax_t increment;
+            if (parse_uint(optarg, &increment, 19) == -1) {
+                fputs("xpipe: invalid nice increment\n", stderr);
+                return -1;
+            }
+            errno = 0;
+            int nice = getpriority(PRIO_PROCESS, 0);
+            if (nice == -1 && errno != 0) {
+                perror("xpipe: failed to get priority");
+                return -1;
+            }
+            nice += (int) increment;
+            config->placement.nice = nice < 19 ? nice : 19;
+            config->placement.has_nice = 1;
+            break;
+          }
+
+          case opt_ionice:
+#if defined(HAVE_IOPRIO)
+            if (parse_ionice(optarg, &config->placement) == -1) {
+                fputs("xpipe: invalid I/O priority\n", stderr);
+                return -1;
+            }
+            break;
+#else
+            fputs("xpipe: --ionice is not supported on this platform\n", stderr);
+            return -1;
+#endif
+
+          case 'h':
+            usage();
+            exit(0);
+
+          default:
+            return -1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+#if defined(HAVE_SCHED_AFFINITY)
+    if (sched_getaffinity(0, sizeof config->placement.own_cpus, &config->placement.own_cpus) == -1) {
+        perror("xpipe: failed to get CPU affinity");
+        return -1;
+    }
+#endif
+    if (config->auto_jobs) {
+        config->jobs = available_cpus(&config->placement);
+    }
+
+    if (config->batch_size > config->buf_size) {
+        fputs("xpipe: chunk size exceeds buffer size\n", stderr);
+        return -1;
+    }
+    if (config->record.type == record_delim && config->record.delim == NULL &&
+        parse_delim("\\n", &config->record) == -1) {
+        perror("xpipe: failed to allocate memory");
+        return -1;
+    }
+    if (config->buf_size < (config->record.type == record_u32be ? 4 : config->record.delim_size)) {
+        fputs("xpipe: buffer size smaller than record delimiter\n", stderr);
+        return -1;
+    }
+    if (config->mem == 0) {
+        // Room for a chunk being written to each command and one being read,
+        // and for the captured output of each command.
+        size_t units = config->jobs < SIZE_MAX / 2 ? config->jobs : SIZE_MAX / 2;
+        if (config->keep_order || config->collect) {
+            units *= 2;
+        }
+        if (config->buf_size > 0 && units >= SIZE_MAX / config->buf_size) {
+            config->mem = SIZE_MAX;
+        } else {
+            config->mem = config->buf_size * (units + 1);
+        }
+    }
+    if (config->mem < config->buf_size) {
+        fputs("xpipe: memory size is smaller than buffer size\n", stderr);
+        return -1;
+    }
+    if (config->persistent && config->keep_order) {
+        fputs("xpipe: --keep-order cannot be used with --persistent\n", stderr);
+        return -1;
+    }
+    if (config->persistent && config->key.type != key_none) {
+        fputs("xpipe: --key cannot be used with --persistent\n", stderr);
+        return -1;
+    }
+    if (config->compress_threads > 0 && config->compress == compress_none) {
+        fputs("xpipe: --compress-threads requires --compress\n", stderr);
+        return -1;
+    }
+    if (config->persistent && config->retries > 0) {
+        fputs("xpipe: --retry cannot be used with --persistent\n", stderr);
+        return -1;
+    }
+    if (config->persistent && config->stdin_mode != stdin_pipe) {
+        fputs("xpipe: --stdin=memfd cannot be used with --persistent\n", stderr);
+        return -1;
+    }
+    if (config->adaptive) {
+        size_t max = config->batch_size > 0 ? config->batch_size : config->buf_size;
+        if (config->adaptive_max == 0) {
+            config->adaptive_max = max;
+            config->adaptive_min = config->adaptive_min > 0 ? config->adaptive_min : 4096;
+            if (config->adaptive_min > max) {
+                config->adaptive_min = max;
+            }
+        }
+        if (config->adaptive_min == 0 || config->adaptive_min > config->adaptive_max ||
+            config->adaptive_max > max) {
+            fputs("xpipe: adaptive chunk size out of range\n", stderr);
+            return -1;
+        }
+    }
+    if (config->persistent && config->adaptive) {
+        fputs("xpipe: --adaptive cannot be used with --persistent\n", stderr);
+        return -1;
+    }
+    if (config->persistent && config->frame == frame_u32be && config->buf_size > UINT32_MAX) {
+        fputs("xpipe: buffer size too large for u32be frame\n", stderr);
+        return -1;
+    }
+
+    static char cat[] = "cat";
+    static char *default_command[] = {
+        cat, NULL
+    };
+    config->command.argv = argc > 0 ? argv : default_command;
+
+    // Resolve the program once here rather than searching PATH on each spawn.
+    config->command.path = find_program(config->command.argv[0]);
+    if (config->command.path == NULL) {
+        fprintf(stderr, "xpipe: command not found: %s\n", config->command.argv[0]);
+        return -1;
+    }
+    if (parse_template(&config->command) == -1) {
+        perror("xpipe: failed to allocate memory");
+        return -1;
+    }
+
+    return 0;
+}
+
+// run executes the main functionality: Reads stdin by chunk and sends lines in
+// each chunk to a command via pipe.
+//
+// Returns 0 on success or -1 on error.
+int run(const struct config *config)
+{
+    if (setup_sigchld() == -1 || setup_sigusr1() == -1 || setup_drain() == -1 ||
+        ignore_sigpipe() == -1) {
+        perror("xpipe: failed to set up signal handler");
+        return -1;
+    }
+
+    struct ring ring;
+    struct jobs jobs = {
+        .command    = &config->command,
+        .ring       = &ring,
+        .pool       = { .used = 0, .cached = 0, .limit = config->mem },
+        .slots      = calloc(config->jobs, sizeof(struct job)),
+        .capacity   = config->jobs,
+        .running    = 0,
+        .status     = 0,
+        .keep_order = config->keep_order,
+        .collect    = config->collect && !config->keep_order,
+        .record     = &config->record,
+        .out_owner  = NULL,
+        .persistent = config->persistent,
+        .balance    = config->balance,
+        .frame      = config->frame,
+        .frame_record = config->frame_record,
+        .compress   = config->compress,
+        .compress_level = config->compress_level,
+        .stdin_mode = config->stdin_mode,
+        .retries    = config->retries,
+        .backoff_min = config->backoff_min,
+        .backoff_max = config->backoff_max,
+        .nb_waiting = 0,
+        .compressors = NULL,
+        .nb_compressors = 0,
+        .nb_compressing = 0,
+        .next_task  = 0,
+        .next_result = 0,
+        .compress_notify = { -1, -1 },
+        .next_worker = 0,
+        .out_cap    = config->buf_size,
+        .out_seq    = 0,
+        .offset     = 0,
+        .env        = NULL,
+        .env_base   = 0,
+        .error      = NULL,
+        .placement  = &config->placement,
+        .draining   = 0,
+        .grace      = config->grace,
+        .has_grace_deadline = 0,
+        .chunks     = NULL,
+        .chunk_cap  = 0,
+        .chunk_first = 0,
+        .chunk_count = 0,
+        .chunk_pending = 0,
+        .chunk_seq  = 0,
+        .stats      = {
+            .count_records = is_positive(&config->stats_interval),
+            .interval   = config->stats_interval,
+        },
+        .adaptive   = {
+            .enabled    = config->adaptive,
+            .min        = config->adaptive_min,
+            .max        = config->adaptive_max,
+            .overhead   = (double) config->overhead / 100,
+            .size       = config->adaptive_min,
+            .window     = (double) config->jobs,
+        },
+    };
+    if (jobs.slots == NULL || init_ring(&ring, config->mem) == -1) {
+        perror("xpipe: failed to allocate memory");
+        free(jobs.slots);
+        return -1;
+    }
+    if (config->prefault) {
+        prefault_ring(&ring);
+    }
+    if (is_positive(&config->stats_interval)) {
+        if (monoclock(&jobs.stats.next_report) == -1) {
+            perror("xpipe: failed to read clock");
+            free_ring(&ring);
+            free(jobs.slots);
+            return -1;
+        }
+        add(&jobs.stats.next_report, &config->stats_interval, &jobs.stats.next_report);
+    }
+    if (init_loop(&jobs.loop) == -1) {
+        perror("xpipe: failed to set up event loop");
+        free_ring(&ring);
+        free(jobs.slots);
+        return -1;
+    }
+
+    struct inputs inputs;
+    if (open_inputs(&inputs, config) == -1) {
+        free_loop(&jobs.loop);
+        free_ring(&ring);
+        free(jobs.slots);
+        return -1;
+    }
+
+    struct shards shards;
+    int keyed = config->key.type != key_none;
+    if (keyed && init_shards(&shards) == -1) {
+        perror("xpipe: failed to allocate memory");
+        free_inputs(&inputs);
+        free_loop(&jobs.loop);
+        free_ring(&ring);
+        free(jobs.slots);
+        return -1;
+    }
+
+    if (config->compress_threads > 0 && start_compressors(&jobs, config->compress_threads) == -1) {
+        perror("xpipe: failed to start threads");
+        if (keyed) {
+            free_shards(&shards, &jobs.pool);
+        }
+        free_inputs(&inputs);
+        free_loop(&jobs.loop);
+        free_ring(&ring);
+        free(jobs.slots);
+        return -1;
+    }
+
+    int result = do_run(config, &ring, &jobs, keyed ? &shards : NULL, &inputs);
+    stop_compressors(&jobs);
+    free_inputs(&inputs);
+    if (is_positive(&config->stats_interval) && report_stats(&jobs.stats, NULL) == -1) {
+        perror("xpipe: failed to report statistics");
+    }
+    if (keyed) {
+        free_shards(&shards, &jobs.pool);
+    }
+    for (size_t i = 0; i < jobs.chunk_count; i++) {
+        free_chunk(&jobs, &jobs.chunks[(jobs.chunk_first + i) % jobs.chunk_cap]);
+    }
+    for (size_t i = 0; i < jobs.capacity; i++) {
+        release_output(&jobs, &jobs.slots[i]);
+    }
+    free_pool(&jobs.pool);
+    free_ring(&ring);
+    free(jobs.slots);
+    free(jobs.chunks);
+    free(jobs.env);
+    free_loop(&jobs.loop);
+    return result;
+}
+
+// do_run implements run() using given ring buffer, job table and inputs. If
+// shards is not NULL, lines are batched by key in there.
+//
+// Returns 0 on success or -1 on error.
+int do_run(const struct config *config, struct ring *ring, struct jobs *jobs, struct shards *shards,
+           struct inputs *inputs)
+{
+    const int timed = is_positive(&config->timeout) ||
+                      is_positive(&config->max_delay) ||
+                      is_positive(&config->idle);
+
+    if (jobs->persistent && start_workers(jobs) == -1) {
+        report_error(jobs, "xpipe: failed to start command");
+        return -1;
+    }
+
+    // -t: Deadline armed on the first read to empty buffer.
+    struct timeval timeout_deadline;
+    int timeout_armed = 0;
+
+    // --max-delay and --idle: Deadlines derived from arrival times.
+    struct arrivals arrivals = { .count = 0 };
+    struct timeval last_read = { 0, 0 };
+    struct timeval now = { 0, 0 };
+
+    // Only newly read bytes are searched for newlines.
+    struct line_scan scan = { 0, 0, 0 };
+
+    // Stream offset of the head of the buffer.
+    uintmax_t offset = 0;
+
+    // A line longer than the buffer goes to a temporary file up to its end.
+    struct spill spill = { -1, 0, 0 };
+
+    // --key: Each batch is sent after -t or --max-delay since its first line.
+    struct timeval key_delay = config->timeout;
+    if (is_positive(&config->max_delay) &&
+        (!is_positive(&key_delay) || earlier(&config->max_delay, &key_delay))) {
+        key_delay = config->max_delay;
+    }
+
+    // A regular file is cut into chunks in place, with nothing left to read.
+    struct mapping mapping;
+    int mapped = shards == NULL && map_input(inputs, &mapping);
+    if (mapped && pipe_mapped(config, jobs, &mapping) == -1) {
+        report_error(jobs, "xpipe: failed to write to pipe");
+        return -1;
+    }
+    if (mapped && drain_requested) {
+        // The rest of the file is left unread for another process.
+        off_t rest = mapping.start + (off_t) (mapping.offset + mapping.sent);
+        if (lseek(inputs->sources[0]->fd, rest, SEEK_SET) == -1 || begin_drain(jobs, inputs) == -1) {
+            report_error(jobs, "xpipe: failed to stop input");
+            return -1;
+        }
+    }
+
+    while (!mapped) {
+        if (drain_requested && begin_drain(jobs, inputs) == -1) {
+            report_error(jobs, "xpipe: failed to stop input");
+            return -1;
+        }
+
+        char *buf = ring->base + ring->head;
+        size_t avail = ring->size;
+        size_t limit = chunk_limit(config, jobs);
+
+        struct timeval deadline;
+        int has_deadline = 0;
+
+        if (timeout_armed) {
+            pick_deadline(&deadline, &has_deadline, &timeout_deadline);
+        }
+        if (is_positive(&config->max_delay) && arrivals.count > 0) {
+            struct timeval max_delay_deadline;
+            add(&arrivals.entries[0].time, &config->max_delay, &max_delay_deadline);
+
+            // An overdue line is sent as soon as it completes. Do not spin
+            // on a deadline that cannot flush anything until then.
+            if (scan.size > 0 || earlier(&now, &max_delay_deadline)) {
+                pick_deadline(&deadline, &has_deadline, &max_delay_deadline);
+            }
+        }
+        if (shards && is_positive(&key_delay) && shards->oldest) {
+            struct timeval key_deadline;
+            add(&shards->oldest->first, &key_delay, &key_deadline);
+            pick_deadline(&deadline, &has_deadline, &key_deadline);
+        }
+        if (is_positive(&config->idle) && (shards ? shards->count > 0 : scan.size > 0)) {
+            struct timeval idle_deadline;
+            add(&last_read, &config->idle, &idle_deadline);
+            pick_deadline(&deadline, &has_deadline, &idle_deadline);
+        }
+
+        // Read up to the chunk size, or up to the buffer size if the chunk
+        // does not contain a complete line, within what is left of --mem.
+        size_t space = (avail < limit ? limit : config->buf_size) - avail;
+        if (space > ring_space(ring)) {
+            space = ring_space(ring);
+        }
+        size_t used = memory_used(jobs);
+        if (used + space > config->mem && jobs->pool.cached > 0) {
+            // Buffers kept for reuse are given up first.
+            size_t excess = used + space - config->mem;
+            trim_pool(&jobs->pool, jobs->pool.cached > excess ? jobs->pool.cached - excess : 0);
+            used = memory_used(jobs);
+        }
+        if (shards && used >= config->mem && shards->oldest && jobs->chunk_pending == 0) {
+            // Out of budget with commands to spare. Send the oldest batch
+            // early rather than waiting for its timeout.
+            if (send_shard(jobs, shards, shards->oldest, flush_mem) == -1) {
+                report_error(jobs, "xpipe: failed to write to pipe");
+                return -1;
+            }
+            continue;
+        }
+        // Captured outputs of persistent commands may wait for more input,
+        // so they do not stop reading while nothing else is buffered.
+        int stalled = jobs->persistent && jobs->chunk_count == 0;
+        if (!stalled && space > config->mem - (used < config->mem ? used : config->mem)) {
+            space = config->mem - (used < config->mem ? used : config->mem);
+        }
+
+        ssize_t nb_read;
+        if (space > 0) {
+            nb_read = read_inputs(jobs, inputs, buf + avail, space, has_deadline ? &deadline : NULL);
+        } else {
+            // Out of budget. Wait for commands to consume their input.
+            if (wait_io(jobs, -1, has_deadline ? &deadline : NULL) == 0) {
+                errno = EWOULDBLOCK;
+            }
+            nb_read = -1;
+        }
+        if (nb_read == 0) {
+            break;
+        }
+
+        // SIGHUP sends buffered lines as on timeout.
+        int hangup = flush_requested;
+        flush_requested = 0;
+
+        if (nb_read == -1) {
+            if (errno == EINTR) {
+                // Commands have made progress. Stop if any of them failed.
+                if (jobs->status != 0) {
+                    break;
+                }
+                if (!hangup) {
+                    continue;
+                }
+            } else if (errno != EWOULDBLOCK) {
+                report_error(jobs, "xpipe: failed to read input");
+                return -1;
+            }
+            nb_read = 0; // Time out.
+        }
+
+        if (timed && monoclock(&now) == -1) {
+            perror("xpipe: failed to read clock");
+            return -1;
+        }
+
+        if (nb_read > 0 && timed && !shards) {
+            record_arrival(&arrivals, offset + avail, &now);
+            last_read = now;
+
+            // Trigger a timeout measurement on the first read to empty buffer.
+            if (is_positive(&config->timeout) && avail == 0) {
+                add(&now, &config->timeout, &timeout_deadline);
+                timeout_armed = 1;
+            }
+        }
+
+        if (nb_read > 0 && shards) {
+            last_read = now;
+        }
+        jobs->stats.bytes_in += (uintmax_t) nb_read;
+
+        avail += (size_t) nb_read;
+        ring->size = avail;
+
+        if (spill.fd != -1) {
+            // The spilled record continues up to its end.
+            int complete;
+            ssize_t nb_spilled = spill_record(ring, &spill, &config->record, &complete);
+            if (nb_spilled == -1) {
+                perror("xpipe: failed to write temporary file");
+                return -1;
+            }
+            buf = ring->base + ring->head;
+            avail = ring->size;
+            offset += (uintmax_t) nb_spilled;
+            forget_arrivals(&arrivals, offset, offset + avail);
+            timeout_armed = 0;
+            if (!complete) {
+                continue;
+            }
+            if (pipe_spill(jobs, config, &spill) == -1) {
+                report_error(jobs, "xpipe: failed to write to pipe");
+                return -1;
+            }
+            if (jobs->status != 0) {
+                break;
+            }
+        }
+
+        if (shards) {
+            // Complete lines are moved to the batches of their keys at once.
+            scan_lines(&scan, &config->record, buf, avail, 0);
+            if (route_lines(jobs, shards, config, buf, scan.size, &now) == -1) {
+                report_error(jobs, "xpipe: failed to write to pipe");
+                return -1;
+            }
+            consume_ring(ring, scan.size);
+            release_ring(ring, scan.size);
+            scan.scanned -= scan.size;
+            scan.size = 0;
+
+            int reason = earlier(&key_delay, &config->timeout) || !is_positive(&config->timeout)
+                ? flush_delay : flush_timeout;
+            if (is_positive(&key_delay) &&
+                send_overdue(jobs, shards, &key_delay, &now, reason) == -1) {
+                report_error(jobs, "xpipe: failed to write to pipe");
+                return -1;
+            }
+            if (hangup && send_shards(jobs, shards, flush_hangup) == -1) {
+                report_error(jobs, "xpipe: failed to write to pipe");
+                return -1;
+            }
+            if (is_positive(&config->idle) && nb_read == 0) {
+                struct timeval idle_deadline;
+                add(&last_read, &config->idle, &idle_deadline);
+                if (!earlier(&now, &idle_deadline) && send_shards(jobs, shards, flush_idle) == -1) {
+                    report_error(jobs, "xpipe: failed to write to pipe");
+                    return -1;
+                }
+            }
+            if (jobs->status != 0) {
+                break;
+            }
+            if (ring->size == config->buf_size) {
+                // No record ends in the whole buffer. Spill the record.
+                int complete;
+                if (spill_record(ring, &spill, &config->record, &complete) == -1) {
+                    perror("xpipe: failed to write temporary file");
+                    return -1;
+                }
+                scan.scanned = 0;
+            }
+            continue;
+        }
+
+        scan_lines(&scan, &config->record, buf, avail, config->batch_lines);
+
+        // A single read may complete several chunks of lines.
+        for (int timed_out = nb_read == 0 || hangup;; timed_out = 0) {
+            int full = avail == config->buf_size;
+            int ready = (avail >= limit && scan.size > 0) ||
+                        (config->batch_lines > 0 && scan.count == config->batch_lines);
+            int overdue = 0;
+
+            if (is_positive(&config->max_delay) && arrivals.count > 0 && scan.size > 0) {
+                struct timeval max_delay_deadline;
+                add(&arrivals.entries[0].time, &config->max_delay, &max_delay_deadline);
+                overdue = !earlier(&now, &max_delay_deadline);
+            }
+
+            if (!full && !ready && !timed_out && !overdue) {
+                break;
+            }
+
+            int reason = config->batch_lines > 0 && scan.count == config->batch_lines ? flush_count
+                       : full ? flush_full
+                       : ready ? flush_size
+                       : overdue ? flush_delay
+                       : hangup ? flush_hangup
+                       : timeout_armed && !earlier(&now, &timeout_deadline) ? flush_timeout
+                       : flush_idle;
+            size_t records = config->batch_lines > 0 ? scan.count
+                           : jobs->stats.count_records ? count_records(&config->record, buf, scan.size)
+                           : 0;
+
+            ssize_t nb_used = pipe_lines(jobs, scan.size);
+            if (nb_used == -1) {
+                report_error(jobs, "xpipe: failed to write to pipe");
+                return -1;
+            }
+            if (nb_used > 0) {
+                note_chunk(&jobs->stats, reason, (size_t) nb_used, records);
+                add_sample(&jobs->stats.carry_bytes, ring->size);
+            }
+            if (jobs->status != 0) {
+                break;
+            }
+
+            buf = ring->base + ring->head;
+            avail = ring->size;
+            offset += (uintmax_t) nb_used;
+            forget_arrivals(&arrivals, offset, offset + avail);
+
+            scan.scanned -= (size_t) nb_used;
+            scan.size = 0;
+            scan.count = 0;
+
+            timeout_armed = 0;
+
+            if (nb_used == 0) {
+                break;
+            }
+            scan_lines(&scan, &config->record, buf, avail, config->batch_lines);
+        }
+        if (jobs->status != 0) {
+            break;
+        }
+
+        if (avail == config->buf_size) {
+            // No record ends in the whole buffer. Spill the record.
+            int complete;
+            ssize_t nb_spilled = spill_record(ring, &spill, &config->record, &complete);
+            if (nb_spilled == -1) {
+                perror("xpipe: failed to write temporary file");
+                return -1;
+            }
+            offset += (uintmax_t) nb_spilled;
+            forget_arrivals(&arrivals, offset, offset + ring->size);
+            scan.scanned = 0;
+            timeout_armed = 0;
+        }
+    }
+
+    if (spill.fd != -1) {
+        // The last record without its end, including a partial delimiter.
+        if (jobs->status == 0 && spill_input(ring, &spill, ring->size) == -1) {
+            perror("xpipe: failed to write temporary file");
+            return -1;
+        }
+        if (jobs->status == 0 && pipe_spill(jobs, config, &spill) == -1) {
+            report_error(jobs, "xpipe: failed to write to pipe");
+            return -1;
+        }
+        if (spill.fd != -1) {
+            close_or_exit(spill.fd, 1);
+        }
+    }
+
+    if (shards && jobs->status == 0) {
+        // The last line without newline goes to its batch as is.
+        size_t size = ring->size;
+        if (route_lines(jobs, shards, config, ring->base + ring->head, size, &now) == -1 ||
+            send_shards(jobs, shards, flush_eof) == -1) {
+            report_error(jobs, "xpipe: failed to write to pipe");
+            return -1;
+        }
+        consume_ring(ring, size);
+        release_ring(ring, size);
+    }
+    if (ring->size > 0 && jobs->status == 0) {
+        size_t records = jobs->stats.count_records || config->batch_lines > 0
+                       ? count_records(&config->record, ring->base + ring->head, ring->size) : 0;
+        note_chunk(&jobs->stats, flush_eof, ring->size, records);
+        if (pipe_data(jobs, ring->size) == -1) {
+            report_error(jobs, "xpipe: failed to write to pipe");
+            return -1;
+        }
+    }
+
+    // The first non-zero exit status of the commands becomes that of xpipe.
+    if (finish_jobs(jobs) == -1) {
+        report_error(jobs, "xpipe: failed to wait for command");
+        return -1;
+    }
+    if (mapped) {
+        munmap(mapping.base, mapping.length);
+    }
+    if (jobs->status != 0) {
+        exit(jobs->status);
+    }
+
+    return 0;
+}
+
+// spill_record moves data of a record too long for the input buffer from the
+// head of the buffer to the spill file. A partial delimiter at the end of the
+// buffer is kept there to be matched with more data. The size of the rest of
+// a length-prefixed record is taken from its prefix when spilling starts.
+//
+// Returns the number of bytes moved on success or -1 on error. *complete is
+// set to whether the record ends in the buffer.
+ssize_t spill_record(struct ring *ring, struct spill *spill, const struct record_spec *spec, int *complete)
+{
+    const char *buf = ring->base + ring->head;
+    size_t size;
+
+    if (spec->type == record_u32be) {
+        if (spill->fd == -1) {
+            const unsigned char *prefix = (const unsigned char *) buf;
+            spill->need = 4 + ((size_t) prefix[0] << 24 | (size_t) prefix[1] << 16 |
+                               (size_t) prefix[2] << 8 | (size_t) prefix[3]);
+        }
+        *complete = spill->need <= ring->size;
+        size = *complete ? spill->need : ring->size;
+        spill->need -= size;
+    } else {
+        ssize_t end = end_of_record(spec, buf, ring->size, 0, 0);
+        *complete = end != -1;
+        size_t keep = spec->delim_size - 1;
+        size = end != -1 ? (size_t) end : ring->size > keep ? ring->size - keep : 0;
+    }
+
+    if (spill_input(ring, spill, size) == -1) {
+        return -1;
+    }
+    return (ssize_t) size;
+}
+
+// spill_input moves data at the head of the input buffer to the spill file,
+// creating the file first if no line is being spilled.
+//
+// Returns 0 on success or -1 on error.
+int spill_input(struct ring *ring, struct spill *spill, size_t size)
+{
+    if (spill->fd == -1) {
+        spill->fd = open_spill();
+        if (spill->fd == -1) {
+            return -1;
+        }
+        spill->size = 0;
+    }
+    if (write_all(spill->fd, ring->base + ring->head, size) == -1) {
+        return -1;
+    }
+    spill->size += size;
+    discard_ring(ring, size);
+    return 0;
+}
+
+// pipe_spill maps the spilled line into memory, queues it as a chunk of its
+// own and closes the file. Pages of the mapping are read from the file as
+// they are written to the command.
+//
+// Returns 0 on success or -1 on error.
+int pipe_spill(struct jobs *jobs, const struct config *config, struct spill *spill)
+{
+    char *data = mmap(NULL, spill->size, PROT_READ, MAP_SHARED, spill->fd, 0);
+    close_or_exit(spill->fd, 1);
+    spill->fd = -1;
+    if (data == MAP_FAILED) {
+        return fail(jobs, "xpipe: failed to map temporary file");
+    }
+
+    struct chunk *chunk = queue_chunk(jobs, data, spill->size);
+    if (chunk == NULL) {
+        munmap(data, spill->size);
+        return -1;
+    }
+    chunk->mapped = 1;
+    note_chunk(&jobs->stats, flush_spill, spill->size, 1);
+
+    if (config->key.type != key_none) {
+        size_t payload_size;
+        const char *payload = record_payload(&config->record, data, spill->size, &payload_size);
+        size_t key_size;
+        const char *key = extract_key(&config->key, payload, payload_size, &key_size);
+        chunk->key = malloc(key_size + 1);
+        if (chunk->key == NULL) {
+            return fail(jobs, "xpipe: failed to allocate memory");
+        }
+        memcpy(chunk->key, key, key_size);
+        chunk->key[key_size] = '\0';
+    }
+    if (jobs->compress != compress_none && compress_queued(jobs, chunk) == -1) {
+        return -1;
+    }
+    return start_jobs(jobs);
+}
+
+// open_spill creates an unlinked temporary file in TMPDIR or /tmp.
+//
+// Returns a file descriptor on success or -1 on error.
+int open_spill(void)
+{
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0') {
+        dir = "/tmp";
+    }
+    char *path = malloc(strlen(dir) + sizeof "/xpipe.XXXXXX");
+    if (path == NULL) {
+        return -1;
+    }
+    strcpy(path, dir);
+    strcat(path, "/xpipe.XXXXXX");
+
+    int fd = mkstemp(path);
+    if (fd != -1) {
+        unlink(path);
+        if (set_cloexec(fd) == -1) {
+            close_or_exit(fd, 1);
+            fd = -1;
+        }
+    }
+    free(path);
+    return fd;
+}
+
+// open_inputs opens the input paths of config, or stdin if none. Regular files
+// are advised to be read sequentially.
+//
+// Returns 0 on success or -1 on error, after printing the error.
+int open_inputs(struct inputs *inputs, const struct config *config)
+{
+    inputs->sources = NULL;
+    inputs->count = 0;
+    inputs->capacity = 0;
+    inputs->next = 0;
+    inputs->owner = NULL;
+    inputs->need = 0;
+    inputs->tail_size = 0;
+    inputs->buf_size = config->buf_size;
+    inputs->spec = &config->record;
+    inputs->tail = malloc(config->record.delim_size);
+    if (inputs->tail == NULL) {
+        perror("xpipe: failed to allocate memory");
+        return -1;
+    }
+
+    const char *const default_inputs[] = { "-" };
+    const char *const *paths = config->nb_inputs > 0 ? config->inputs : default_inputs;
+    size_t nb_paths = config->nb_inputs > 0 ? config->nb_inputs : 1;
+
+    for (size_t i = 0; i < nb_paths; i++) {
+        const char *path = paths[i];
+        int listening = strncmp(path, "unix:", 5) == 0 || strncmp(path, "tcp:", 4) == 0;
+        int fd;
+        if (listening) {
+            fd = open_listener(path);
+        } else if (strcmp(path, "-") == 0) {
+            fd = STDIN_FILENO;
+        } else {
+            // A FIFO would block the open until its writer appears, so
+            // other inputs and signals would wait for it. Reads wait for
+            // data in the event loop instead.
+            fd = open(path, O_RDONLY | O_NONBLOCK);
+            if (fd != -1 && (set_block(fd) == -1 || set_cloexec(fd) == -1)) {
+                close_or_exit(fd, 1);
+                fd = -1;
+            }
+        }
+        if (fd == -1) {
+            fprintf(stderr, "xpipe: %s: %s\n", path, strerror(errno));
+            free_inputs(inputs);
+            return -1;
+        }
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+#endif
+        if (add_source(inputs, fd, path, listening) == -1) {
+            perror("xpipe: failed to allocate memory");
+            if (fd != STDIN_FILENO) {
+                close_or_exit(fd, 1);
+            }
+            free_inputs(inputs);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// free_inputs closes the sources and frees the set.
+void free_inputs(struct inputs *inputs)
+{
+    while (inputs->count > 0) {
+        struct source *source = inputs->sources[inputs->count - 1];
+        if (source->fd > STDIN_FILENO) {
+            close_or_exit(source->fd, 1);
+        }
+        free(source->buf);
+        free(source);
+        inputs->count--;
+    }
+    free(inputs->sources);
+    free(inputs->tail);
+}
+
+// add_source adds a source reading fd to the set. The only source other than
+// a listening socket is read directly into the input buffer; a buffer is
+// given to each source once there are several.
+//
+// Returns 0 on success or -1 on error.
+int add_source(struct inputs *inputs, int fd, const char *name, int listening)
+{
+    if (inputs->count == inputs->capacity) {
+        size_t capacity = inputs->capacity > 0 ? inputs->capacity * 2 : 4;
+        struct source **sources = realloc(inputs->sources, capacity * sizeof *sources);
+        if (sources == NULL) {
+            return -1;
+        }
+        inputs->sources = sources;
+        inputs->capacity = capacity;
+    }
+
+    struct source *source = malloc(sizeof *source);
+    if (source == NULL) {
+        return -1;
+    }
+    *source = (struct source) {
+        .fd        = fd,
+        .listening = listening,
+        .name      = name,
+        .buf       = NULL,
+        .size      = 0,
+        .capacity  = 0,
+        .scan      = { 0, 0, 0 },
+    };
+    inputs->sources[inputs->count++] = source;
+
+    int shared = inputs->count > 1 || listening;
+    for (size_t i = 0; shared && i < inputs->count; i++) {
+        struct source *each = inputs->sources[i];
+        if (each->buf == NULL && !each->listening) {
+            each->buf = malloc(inputs->buf_size + inputs->spec->delim_size);
+            if (each->buf == NULL) {
+                return -1;
+            }
+            each->capacity = inputs->buf_size;
+        }
+    }
+    return 0;
+}
+
+// remove_source removes a source that has ended and passed all of its data.
+void remove_source(struct inputs *inputs, size_t index)
+{
+    struct source *source = inputs->sources[index];
+    free(source->buf);
+    free(source);
+    memmove(&inputs->sources[index], &inputs->sources[index + 1],
+            (inputs->count - index - 1) * sizeof *inputs->sources);
+    inputs->count--;
+    if (inputs->next > index) {
+        inputs->next--;
+    }
+}
+
+// open_listener creates a socket listening on "unix:PATH" or
+// "tcp:[HOST:]PORT". Each accepted connection becomes a source.
+//
+// Returns a file descriptor on success or -1 on error.
+int open_listener(const char *spec)
+{
+    int fd;
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        if (strlen(spec + 5) >= sizeof addr.sun_path) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, spec + 5);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+            return -1;
+        }
+        if (bind(fd, (const struct sockaddr *) &addr, sizeof addr) == -1) {
+            close_or_exit(fd, 1);
+            return -1;
+        }
+    } else {
+        const char *port = strrchr(spec + 4, ':');
+        char host[256] = "";
+        if (port) {
+            size_t len = (size_t) (port - (spec + 4));
+            if (len >= sizeof host) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            memcpy(host, spec + 4, len);
+            host[len] = '\0';
+            port++;
+        } else {
+            port = spec + 4;
+        }
+
+        struct addrinfo hints, *addrs;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int error = getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &addrs);
+        if (error != 0) {
+            errno = error == EAI_SYSTEM ? errno : EINVAL;
+            return -1;
+        }
+
+        fd = -1;
+        for (const struct addrinfo *addr = addrs; addr && fd == -1; addr = addr->ai_next) {
+            fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (fd == -1) {
+                continue;
+            }
+            int on = 1;
+            if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) == -1 ||
+                bind(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+                int saved_errno = errno;
+                close_or_exit(fd, 1);
+                errno = saved_errno;
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addrs);
+        if (fd == -1) {
+            return -1;
+        }
+    }
+
+    if (listen(fd, SOMAXCONN) == -1 || set_nonblock(fd) == -1 || set_cloexec(fd) == -1) {
+        int saved_errno = errno;
+        close_or_exit(fd, 1);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+// read_inputs reads data of the sources into buf, waiting for any of them as
+// try_read() does. The only source is read directly. Otherwise, complete
+// records of one source are passed at a time, taking turns.
+//
+// Returns the number of bytes read, 0 at the end of all inputs, or -1 on
+// error. errno is set to EWOULDBLOCK on timeout, or EINTR if commands have
+// made progress.
+ssize_t read_inputs(struct jobs *jobs, struct inputs *inputs, char *buf, size_t size,
+                    const struct timeval *deadline)
+{
+    if (inputs->count == 1 && inputs->sources[0]->buf == NULL) {
+        struct source *source = inputs->sources[0];
+        if (source->fd == -1) {
+            return 0;
+        }
+        ssize_t nb_read = try_read(jobs, source->fd, buf, size, deadline);
+        if (nb_read == 0) {
+            end_source(jobs, inputs, source);
+        }
+        return nb_read;
+    }
+
+    for (;;) {
+        size_t nb_taken = take_input(inputs, buf, size);
+        if (nb_taken > 0) {
+            return (ssize_t) nb_taken;
+        }
+
+        // Sources read are those with room in the buffer, or only the owner.
+        int stack_fds[16];
+        int *fds = inputs->count <= 16 ? stack_fds : malloc(inputs->count * sizeof *fds);
+        if (fds == NULL) {
+            return fail(jobs, "xpipe: failed to allocate memory");
+        }
+        size_t nb_fds = 0;
+        for (size_t i = 0; i < inputs->count; i++) {
+            const struct source *source = inputs->sources[i];
+            if (source->fd != -1 && (inputs->owner == NULL || inputs->owner == source) &&
+                (source->listening || source->size < source->capacity)) {
+                fds[nb_fds++] = source->fd;
+            }
+        }
+        if (nb_fds == 0) {
+            if (fds != stack_fds) {
+                free(fds);
+            }
+            return 0;
+        }
+
+        int ready = wait_fds(jobs, fds, nb_fds, deadline);
+        if (fds != stack_fds) {
+            free(fds);
+        }
+        if (ready == -1) {
+            return -1;
+        }
+        if (ready == 0) {
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+
+        // Accepted connections are added at the end and read in next rounds.
+        for (size_t i = 0, count = inputs->count; i < count; i++) {
+            const struct source *source = inputs->sources[i];
+            if (source->fd != -1 && (ready_events(&jobs->loop, source->fd) & ev_read) &&
+                fill_source(jobs, inputs, i) == -1) {
+                return fail(jobs, "xpipe: failed to read input");
+            }
+        }
+    }
+}
+
+// fill_source reads available data of a source into its buffer, or accepts a
+// connection if listening.
+//
+// Returns 0 on success or -1 on error.
+int fill_source(struct jobs *jobs, struct inputs *inputs, size_t index)
+{
+    struct source *source = inputs->sources[index];
+
+    if (source->listening) {
+        int fd = accept(source->fd, NULL, NULL);
+        if (fd == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+                   errno == ECONNABORTED ? 0 : -1;
+        }
+        if (set_nonblock(fd) == -1 || set_cloexec(fd) == -1 ||
+            add_source(inputs, fd, source->name, 0) == -1) {
+            close_or_exit(fd, 1);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (source->size == source->capacity) {
+        return 0;
+    }
+    ssize_t nb_read = read(source->fd, source->buf + source->size, source->capacity - source->size);
+    if (nb_read == -1) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+    if (nb_read == 0) {
+        end_source(jobs, inputs, source);
+        return 0;
+    }
+    source->size += (size_t) nb_read;
+    return 0;
+}
+
+// end_source closes a source at the end of its input. An incomplete record
+// left by the source is terminated with the delimiter so that it does not
+// join a record of another source. A truncated length-prefixed record is
+// padded with NUL bytes when passed; see take_input().
+void end_source(struct jobs *jobs, struct inputs *inputs, struct source *source)
+{
+    forget_fd(&jobs->loop, source->fd);
+    if (source->fd > STDIN_FILENO) {
+        close_or_exit(source->fd, 1);
+    }
+    source->fd = -1;
+
+    const struct record_spec *spec = inputs->spec;
+    if (source->buf == NULL || spec->type != record_delim) {
+        return;
+    }
+
+    // The end of the last record may have been passed by the owner already.
+    size_t size = spec->delim_size;
+    int ended;
+    if (source->size >= size) {
+        ended = memcmp(source->buf + source->size - size, spec->delim, size) == 0;
+    } else {
+        size_t passed = size - source->size;
+        ended = inputs->owner == source && inputs->tail_size >= passed &&
+                memcmp(inputs->tail + inputs->tail_size - passed, spec->delim, passed) == 0 &&
+                memcmp(source->buf, spec->delim + passed, source->size) == 0;
+    }
+    if (!ended && (source->size > 0 || inputs->owner == source)) {
+        memcpy(source->buf + source->size, spec->delim, spec->delim_size);
+        source->size += spec->delim_size;
+    }
+}
+
+// take_input moves data of a source to buf. Complete records are taken from
+// the sources in turn; if the first record of a source does not fit, the
+// source becomes the owner and passes the record in pieces.
+//
+// Returns the number of bytes moved, which is zero if no source has data.
+size_t take_input(struct inputs *inputs, char *buf, size_t size)
+{
+    const struct record_spec *spec = inputs->spec;
+
+    if (inputs->owner) {
+        return pass_owner(inputs, buf, size);
+    }
+
+    for (size_t n = 0; n < inputs->count; n++) {
+        size_t index = (inputs->next + n) % inputs->count;
+        struct source *source = inputs->sources[index];
+        if (source->size == 0) {
+            if (source->fd == -1) {
+                remove_source(inputs, index);
+                n--;
+            }
+            continue;
+        }
+
+        scan_lines(&source->scan, spec, source->buf, source->size, 0);
+        size_t nb_taken = source->scan.size;
+        if (nb_taken > size) {
+            struct line_scan fit = { 0, 0, 0 };
+            scan_lines(&fit, spec, source->buf, size, 0);
+            nb_taken = fit.size;
+        }
+        if (nb_taken > 0) {
+            memcpy(buf, source->buf, nb_taken);
+            memmove(source->buf, source->buf + nb_taken, source->size - nb_taken);
+            source->size -= nb_taken;
+            source->scan.scanned -= nb_taken;
+            source->scan.size -= nb_taken;
+            inputs->next = (index + 1) % inputs->count;
+            return nb_taken;
+        }
+
+        int truncated = spec->type == record_u32be && source->fd == -1;
+        if (truncated) {
+            fprintf(stderr, "xpipe: %s: truncated record\n", source->name);
+            if (source->size < 4) {
+                source->size = 0; // Not even a length. Drop it.
+                continue;
+            }
+        }
+        if (source->scan.size > 0 || source->size == source->capacity || truncated) {
+            inputs->owner = source;
+            inputs->tail_size = 0;
+            if (spec->type == record_u32be) {
+                const unsigned char *prefix = (const unsigned char *) source->buf;
+                inputs->need = 4 + ((size_t) prefix[0] << 24 | (size_t) prefix[1] << 16 |
+                                    (size_t) prefix[2] << 8 | (size_t) prefix[3]);
+            }
+            inputs->next = (index + 1) % inputs->count;
+            return pass_owner(inputs, buf, size);
+        }
+    }
+    return 0;
+}
+
+// pass_owner moves data of the record of the owner to buf, up to its end if
+// found. The end of the record passed so far is kept in inputs->tail to find
+// a delimiter split between pieces.
+//
+// Returns the number of bytes moved.
+size_t pass_owner(struct inputs *inputs, char *buf, size_t size)
+{
+    const struct record_spec *spec = inputs->spec;
+    struct source *source = inputs->owner;
+    size_t nb_passed;
+    int ended;
+
+    if (spec->type == record_u32be) {
+        nb_passed = inputs->need < source->size ? inputs->need : source->size;
+        if (nb_passed > size) {
+            nb_passed = size;
+        }
+        memcpy(buf, source->buf, nb_passed);
+        if (nb_passed == 0 && source->fd == -1) {
+            // Truncated at the end of input.
+            nb_passed = inputs->need < size ? inputs->need : size;
+            memset(buf, 0, nb_passed);
+        } else {
+            memmove(source->buf, source->buf + nb_passed, source->size - nb_passed);
+            source->size -= nb_passed;
+        }
+        inputs->need -= nb_passed;
+        ended = inputs->need == 0;
+    } else {
+        // A delimiter may start in the tail and end in the buffer.
+        ssize_t end = -1;
+        for (size_t k = inputs->tail_size; k > 0 && end == -1; k--) {
+            size_t rest = spec->delim_size - k;
+            if (memcmp(inputs->tail + inputs->tail_size - k, spec->delim, k) == 0 &&
+                rest <= source->size && memcmp(source->buf, spec->delim + k, rest) == 0) {
+                end = (ssize_t) rest;
+            }
+        }
+        if (end == -1) {
+            end = end_of_record(spec, source->buf, source->size, 0, 0);
+        }
+        nb_passed = end != -1 ? (size_t) end : source->size;
+        if (nb_passed > size) {
+            nb_passed = size;
+        }
+        ended = end != -1 && nb_passed == (size_t) end;
+
+        memcpy(buf, source->buf, nb_passed);
+        memmove(source->buf, source->buf + nb_passed, source->size - nb_passed);
+        source->size -= nb_passed;
+
+        size_t keep = spec->delim_size - 1;
+        if (nb_passed >= keep) {
+            memcpy(inputs->tail, buf + nb_passed - keep, keep);
+            inputs->tail_size = keep;
+        } else {
+            size_t old = inputs->tail_size + nb_passed > keep ? keep - nb_passed : inputs->tail_size;
+            memmove(inputs->tail, inputs->tail + inputs->tail_size - old, old);
+            memcpy(inputs->tail + old, buf, nb_passed);
+            inputs->tail_size = old + nb_passed;
+        }
+    }
+
+    source->scan = (struct line_scan) { 0, 0, 0 };
+    if (ended) {
+        inputs->owner = NULL;
+    }
+    return nb_passed;
+}
+
+// scan_lines searches newly added data for complete records. If max_count is
+// zero, only the end of the last record is searched, backward for a
+// single-byte delimiter. Otherwise, records are counted up to max_count in the
+// same forward pass.
+void scan_lines(struct line_scan *scan, const struct record_spec *spec, const char *buf,
+                size_t size, size_t max_count)
+{
+    if (max_count == 0 && spec->type == record_delim && spec->delim_size == 1) {
+        ssize_t end_pos = find_last(buf + scan->scanned, size - scan->scanned, spec->delim[0]);
+        if (end_pos != -1) {
+            scan->size = scan->scanned + (size_t) end_pos + 1; // Include delimiter.
+        }
+        scan->scanned = size;
+        return;
+    }
+
+    while ((max_count == 0 || scan->count < max_count) && scan->scanned < size) {
+        ssize_t end = end_of_record(spec, buf, size, scan->size, scan->scanned);
+        if (end == -1) {
+            scan->scanned = size;
+            break;
+        }
+        scan->scanned = (size_t) end;
+        scan->size = (size_t) end;
+        scan->count++;
+    }
+}
+
+// end_of_record finds the end of the record starting at start. Data before
+// scanned has been searched for a delimiter already, except for the tail that
+// may hold the beginning of a multi-byte one.
+//
+// Returns the offset after the record or -1 if the record is not complete.
+ssize_t end_of_record(const struct record_spec *spec, const char *buf, size_t size, size_t start,
+                      size_t scanned)
+{
+    if (spec->type == record_u32be) {
+        if (size - start < 4) {
+            return -1;
+        }
+        const unsigned char *prefix = (const unsigned char *) buf + start;
+        size_t length = (size_t) prefix[0] << 24 | (size_t) prefix[1] << 16 |
+                        (size_t) prefix[2] << 8 | (size_t) prefix[3];
+        if (size - start - 4 < length) {
+            return -1;
+        }
+        return (ssize_t) (start + 4 + length);
+    }
+
+    size_t from = scanned > start + spec->delim_size - 1 ? scanned - (spec->delim_size - 1) : start;
+    const char *delim = spec->delim_size == 1
+        ? memchr(buf + from, spec->delim[0], size - from)
+        : find_bytes(buf + from, size - from, spec->delim, spec->delim_size);
+    if (delim == NULL) {
+        return -1;
+    }
+    return (ssize_t) ((size_t) (delim - buf) + spec->delim_size);
+}
+
+// record_payload strips the delimiter or the length prefix from a record.
+//
+// Returns a pointer to the payload and assigns its size to *payload_size.
+const char *record_payload(const struct record_spec *spec, const char *record, size_t size,
+                           size_t *payload_size)
+{
+    if (spec->type == record_u32be) {
+        size_t prefix = size < 4 ? size : 4;
+        *payload_size = size - prefix;
+        return record + prefix;
+    }
+    if (size >= spec->delim_size &&
+        memcmp(record + size - spec->delim_size, spec->delim, spec->delim_size) == 0) {
+        size -= spec->delim_size;
+    }
+    *payload_size = size;
+    return record;
+}
+
+// count_records counts records in data, including an incomplete one at the
+// end.
+//
+// Returns the number of records.
+size_t count_records(const struct record_spec *spec, const char *buf, size_t size)
+{
+    size_t count = 0;
+    size_t start = 0;
+
+    while (start < size) {
+        ssize_t end = end_of_record(spec, buf, size, start, start);
+        start = end != -1 ? (size_t) end : size;
+        count++;
+    }
+    return count;
+}
+
+// chunk_limit computes the size up to which lines are sent in a chunk.
+//
+// Returns the size.
+size_t chunk_limit(const struct config *config, const struct jobs *jobs)
+{
+    if (jobs->adaptive.enabled) {
+        return jobs->adaptive.size;
+    }
+    return config->batch_size > 0 ? config->batch_size : config->buf_size;
+}
+
+// memory_used sums the memory buffered by xpipe, which --mem bounds: input in
+// the ring buffer, and buffers from the pool for chunks in their own storage,
+// batches by key and captured outputs, taken or cached for reuse.
+//
+// Returns the size in bytes.
+size_t memory_used(const struct jobs *jobs)
+{
+    return jobs->ring->pinned + jobs->ring->size + jobs->pool.used + jobs->pool.cached;
+}
+
+// adapt_chunks updates the model of the run time of commands with a command
+// that has succeeded, and picks the chunk size and the number of concurrent
+// commands from it. See struct adaptive.
+void adapt_chunks(struct adaptive *adaptive, size_t size, uintmax_t run_us, size_t capacity)
+{
+    const double decay = 0.9;
+    double x = (double) size;
+    double y = (double) run_us;
+
+    if (adaptive->fitted) {
+        double predicted = adaptive->fixed + adaptive->per_byte * x;
+        if (y > 2 * predicted) {
+            adaptive->window = adaptive->window / 2 > 1 ? adaptive->window / 2 : 1;
+        } else if (adaptive->window < (double) capacity) {
+            adaptive->window += 1 / adaptive->window;
+        }
+    }
+
+    adaptive->weight = adaptive->weight * decay + 1;
+    adaptive->sum_x = adaptive->sum_x * decay + x;
+    adaptive->sum_y = adaptive->sum_y * decay + y;
+    adaptive->sum_xx = adaptive->sum_xx * decay + x * x;
+    adaptive->sum_xy = adaptive->sum_xy * decay + x * y;
+
+    // The fit needs chunks of different sizes; otherwise the last one stands.
+    double mean_x = adaptive->sum_x / adaptive->weight;
+    double mean_y = adaptive->sum_y / adaptive->weight;
+    double var_x = adaptive->sum_xx / adaptive->weight - mean_x * mean_x;
+    double cov_xy = adaptive->sum_xy / adaptive->weight - mean_x * mean_y;
+    if (var_x > mean_x * mean_x / 400) {
+        adaptive->per_byte = cov_xy > 0 ? cov_xy / var_x : 0;
+        adaptive->fixed = mean_y - adaptive->per_byte * mean_x;
+        if (adaptive->fixed < 0) {
+            adaptive->fixed = 0;
+        }
+        adaptive->fitted = 1;
+    }
+
+    double target;
+    if (!adaptive->fitted) {
+        target = (double) adaptive->size * 2;
+    } else if (adaptive->per_byte > 0) {
+        target = adaptive->fixed * (1 - adaptive->overhead) / (adaptive->overhead * adaptive->per_byte);
+    } else {
+        target = (double) adaptive->max;
+    }
+    adaptive->size = target >= (double) adaptive->max ? adaptive->max
+                   : target <= (double) adaptive->min ? adaptive->min
+                   : (size_t) target;
+}
+
+// pipe_lines pipes complete lines at the head of the input buffer to a
+// command. size is the size of the lines, which the caller tracks as data
+// arrives.
+//
+// The function does nothing and succeeds if size is zero, i.e. the data does
+// not contain any newline character.
+//
+// Returns the number of bytes piped on success or -1 on error.
+ssize_t pipe_lines(struct jobs *jobs, size_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+    if (pipe_data(jobs, size) == -1) {
+        return -1;
+    }
+    return (ssize_t) size;
+}
+
+// pipe_data consumes data at the head of the input buffer as a chunk and
+// starts commands for queued chunks as far as job slots allow. The chunk is
+// written in background and its space in the ring buffer stays pinned until
+// released, unless the chunk is compressed into its own storage.
+//
+// A ring buffer that is not mirrored moves data on consumption. In that case
+// the function waits for the chunk to be written before consuming it.
+//
+// Returns 0 on success or -1 on error.
+int pipe_data(struct jobs *jobs, size_t size)
+{
+    struct ring *ring = jobs->ring;
+
+    if (jobs->status != 0) {
+        return 0;
+    }
+    struct chunk *chunk = queue_chunk(jobs, ring->base + ring->head, size);
+    if (chunk == NULL) {
+        return -1;
+    }
+    if (jobs->compress != compress_none && !ring->mirrored) {
+        // Consumption moves the rest of the data over the chunk, so the chunk
+        // gets its own storage first: compressed right away, or copied for
+        // compressor threads.
+        if (jobs->nb_compressors > 0) {
+            size_t copy_cap;
+            char *copy = get_buffer(&jobs->pool, size, &copy_cap);
+            if (copy == NULL) {
+                return fail(jobs, "xpipe: failed to allocate memory");
+            }
+            memcpy(copy, chunk->data, size);
+            replace_data(jobs, chunk, copy, copy_cap, size);
+        } else if (compress_chunk(jobs, chunk) == -1) {
+            return -1;
+        }
+        consume_ring(ring, size);
+        if (jobs->nb_compressors > 0 && submit_chunk(jobs, chunk) == -1) {
+            return -1;
+        }
+        return start_jobs(jobs);
+    }
+    if (jobs->compress != compress_none) {
+        // The compressed copy frees the input buffer once done.
+        consume_ring(ring, size);
+        if (compress_queued(jobs, chunk) == -1) {
+            return -1;
+        }
+        return start_jobs(jobs);
+    }
+    if (ring->mirrored) {
+        consume_ring(ring, size);
+        return start_jobs(jobs);
+    }
+    if (start_jobs(jobs) == -1 || drain_chunks(jobs) == -1) {
+        return -1;
+    }
+    if (jobs->status == 0) {
+        consume_ring(ring, size);
+    }
+    return 0;
+}
+
+// map_input maps the input into memory if it is a single regular file, from
+// its current position up to its current size. The file position is moved to
+// the end as if the file had been read.
+//
+// Returns 1 if the input is mapped, or 0 if it is to be read.
+int map_input(struct inputs *inputs, struct mapping *mapping)
+{
+    if (inputs->count != 1 || inputs->sources[0]->buf != NULL) {
+        return 0;
+    }
+    int fd = inputs->sources[0]->fd;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    off_t position = lseek(fd, 0, SEEK_CUR);
+    if (position == -1 || position >= st.st_size || (uintmax_t) st.st_size > SIZE_MAX) {
+        return 0;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t start = page_size > 0 ? position - position % page_size : 0;
+    size_t length = (size_t) (st.st_size - start);
+    char *base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, start);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+#if defined(POSIX_MADV_SEQUENTIAL)
+    posix_madvise(base, length, POSIX_MADV_SEQUENTIAL);
+#endif
+    if (lseek(fd, st.st_size, SEEK_SET) == -1) {
+        munmap(base, length);
+        return 0;
+    }
+
+    mapping->base = base;
+    mapping->length = length;
+    mapping->offset = (size_t) (position - start);
+    mapping->start = start;
+    mapping->sent = 0;
+    return 1;
+}
+
+// pipe_mapped queues the mapped input as chunks taken in place. The next
+// chunk is cut when a command is free for it, so that it gets the chunk size
+// current then, and pages of the file are read as they are written to the
+// command. Queuing stops on SIGTERM or SIGINT.
+//
+// Returns 0 on success or -1 on error.
+int pipe_mapped(const struct config *config, struct jobs *jobs, struct mapping *mapping)
+{
+    const char *data = mapping->base + mapping->offset;
+    size_t size = mapping->length - mapping->offset;
+
+    while (size > 0 && jobs->status == 0 && !drain_requested) {
+        // Chunks being compressed wait in the queue without a command.
+        if (jobs->chunk_pending > jobs->nb_compressors) {
+            if (wait_io(jobs, -1, NULL) == -1 && errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+
+        size_t limit = chunk_limit(config, jobs);
+        size_t chunk_size = plan_chunk(config, data, size, limit);
+        struct chunk *chunk = queue_chunk(jobs, data, chunk_size);
+        if (chunk == NULL) {
+            return -1;
+        }
+        chunk->in_mapping = 1;
+
+        size_t records = jobs->stats.count_records || config->batch_lines > 0
+                       ? count_records(&config->record, data, chunk_size) : 0;
+        int reason = chunk_size == size ? flush_eof
+                   : config->batch_lines > 0 && records == config->batch_lines ? flush_count
+                   : chunk_size > limit ? flush_spill
+                   : flush_size;
+        note_chunk(&jobs->stats, reason, chunk_size, records);
+        jobs->stats.bytes_in += chunk_size;
+
+        if (jobs->compress != compress_none && compress_queued(jobs, chunk) == -1) {
+            return -1;
+        }
+        if (start_jobs(jobs) == -1) {
+            return -1;
+        }
+        data += chunk_size;
+        size -= chunk_size;
+        mapping->sent += chunk_size;
+    }
+    return 0;
+}
+
+// plan_chunk finds the end of the next chunk in mapped input: the last record
+// ending within limit, up to -n records, or a single record longer than limit.
+// The data left at the end of input goes as is.
+//
+// Returns the size of the chunk.
+size_t plan_chunk(const struct config *config, const char *buf, size_t size, size_t limit)
+{
+    struct line_scan scan = { 0, 0, 0 };
+    scan_lines(&scan, &config->record, buf, size < limit ? size : limit, config->batch_lines);
+    int counted = config->batch_lines > 0 && scan.count == config->batch_lines;
+    if (scan.size > 0 && (size > limit || counted)) {
+        return scan.size;
+    }
+    if (size <= limit) {
+        return size;
+    }
+    ssize_t end = end_of_record(&config->record, buf, size, 0, scan.scanned);
+    return end != -1 ? (size_t) end : size;
+}
+
+// queue_chunk appends a chunk in the ring buffer to the queue, growing it as
+// needed.
+//
+// Returns a pointer to the chunk on success or NULL on error.
+struct chunk *queue_chunk(struct jobs *jobs, const char *buf, size_t size)
+{
+    if (jobs->chunk_count == jobs->chunk_cap) {
+        size_t capacity = jobs->chunk_cap > 0 ? jobs->chunk_cap * 2 : 16;
+        struct chunk *chunks = malloc(capacity * sizeof *chunks);
+        if (chunks == NULL) {
+            fail(jobs, "xpipe: failed to allocate memory");
+            return NULL;
+        }
+        for (size_t i = 0; i < jobs->chunk_count; i++) {
+            chunks[i] = jobs->chunks[(jobs->chunk_first + i) % jobs->chunk_cap];
+        }
+        free(jobs->chunks);
+        jobs->chunks = chunks;
+        jobs->chunk_cap = capacity;
+        jobs->chunk_first = 0;
+    }
+
+    struct chunk *chunk = &jobs->chunks[(jobs->chunk_first + jobs->chunk_count) % jobs->chunk_cap];
+    chunk->data = buf;
+    chunk->size = size;
+    chunk->written = 0;
+    chunk->buffer = NULL;
+    chunk->mapped = 0;
+    chunk->in_mapping = 0;
+    chunk->key = NULL;
+    chunk->offset = jobs->offset;
+    chunk->input_size = size;
+    chunk->records = jobs->persistent ? 0 : count_records(jobs->record, buf, size);
+    chunk->attempts = 0;
+    chunk->waiting = 0;
+    jobs->offset += size;
+    jobs->chunk_count++;
+    jobs->chunk_pending++;
+    return chunk;
+}
+
+// start_jobs assigns pending chunks to commands in order. Each chunk gets a
+// new command while slots are free. In persistent mode, each chunk goes to
+// the worker chosen by pick_worker(). Chunks due for retry come first.
+//
+// Returns 0 on success or -1 on error.
+int start_jobs(struct jobs *jobs)
+{
+    if (jobs->nb_waiting > 0 && start_retries(jobs) == -1) {
+        return -1;
+    }
+
+    // Chunks being compressed are the newest ones and wait in the queue.
+    while (jobs->chunk_pending > jobs->nb_compressing && jobs->status == 0) {
+        uintmax_t seq = jobs->chunk_seq + (jobs->chunk_count - jobs->chunk_pending);
+
+        if (jobs->persistent) {
+            struct job *job;
+            if (pick_worker(jobs, &job) == -1) {
+                return -1;
+            }
+            if (job == NULL) {
+                break;
+            }
+            jobs->chunk_pending--;
+
+            start_input(jobs, job, seq);
+            if (feed_job(jobs, job) == -1) {
+                return -1;
+            }
+        } else {
+            // A slot is kept for each chunk waiting for retry. With -k, the
+            // commands of later chunks cannot leave their slots before it.
+            // With --adaptive, fewer commands may be allowed.
+            size_t capacity = jobs->capacity;
+            if (jobs->adaptive.enabled && (size_t) jobs->adaptive.window < capacity) {
+                capacity = (size_t) jobs->adaptive.window;
+            }
+            if (jobs->running + jobs->nb_waiting >= capacity) {
+                break;
+            }
+            if (jobs->adaptive.enabled) {
+                coalesce_chunks(jobs, seq);
+            }
+            jobs->chunk_pending--;
+
+            if (start_chunk(jobs, free_slot(jobs), seq) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// start_chunk starts a command for a queued chunk in a free slot. The output
+// of the command takes the place of the chunk in the input order.
+//
+// Returns 0 on success or -1 on error.
+int start_chunk(struct jobs *jobs, struct job *job, uintmax_t seq)
+{
+    if (jobs->stdin_mode == stdin_memfd) {
+        // The chunk is written in full before the command starts.
+        size_t size = chunk_at(jobs, seq)->size;
+        if (spawn_file_job(jobs, job, seq) == -1) {
+            return -1;
+        }
+        job->seq = seq;
+        job->size = size;
+        job->input_seq = seq;
+        return 0;
+    }
+
+    int capture = jobs->keep_order || jobs->collect;
+    if (spawn_job(jobs, job, capture, seq, -1) == -1) {
+        return -1;
+    }
+    job->seq = seq;
+    job->size = chunk_at(jobs, seq)->size;
+    start_input(jobs, job, seq);
+    return feed_job(jobs, job);
+}
+
+// coalesce_chunks merges pending chunks following the one at seq into it, as
+// far as they are adjacent in the ring buffer and fit in the adaptive chunk
+// size, so that chunks read ahead before the size has grown are not sent one
+// by one.
+void coalesce_chunks(struct jobs *jobs, uintmax_t seq)
+{
+    if (!jobs->ring->mirrored || jobs->compress != compress_none) {
+        return;
+    }
+
+    struct chunk *chunk = chunk_at(jobs, seq);
+    size_t merged = 0;
+    while (merged + 1 < jobs->chunk_pending) {
+        const struct chunk *next = chunk_at(jobs, seq + merged + 1);
+        if (chunk->buffer || chunk->mapped || chunk->in_mapping ||
+            next->buffer || next->mapped || next->in_mapping ||
+            chunk->data + chunk->size != next->data ||
+            chunk->size + next->size > jobs->adaptive.size) {
+            break;
+        }
+        chunk->size += next->size;
+        chunk->input_size += next->input_size;
+        chunk->records += next->records;
+        merged++;
+    }
+    if (merged == 0) {
+        return;
+    }
+
+    // Close the gap left by the merged chunks, which are the newest but the
+    // rest of the pending ones.
+    uintmax_t end = jobs->chunk_seq + jobs->chunk_count;
+    for (uintmax_t from = seq + merged + 1; from < end; from++) {
+        *chunk_at(jobs, from - merged) = *chunk_at(jobs, from);
+    }
+    jobs->chunk_count -= merged;
+    jobs->chunk_pending -= merged;
+}
+
+// start_retries starts commands again for failed chunks whose backoff has
+// elapsed, oldest first, as far as job slots allow.
+//
+// Returns 0 on success or -1 on error.
+int start_retries(struct jobs *jobs)
+{
+    struct timeval now;
+    if (monoclock(&now) == -1) {
+        return fail(jobs, "xpipe: failed to read clock");
+    }
+
+    size_t assigned = jobs->chunk_count - jobs->chunk_pending;
+    for (size_t i = 0; i < assigned && jobs->nb_waiting > 0; i++) {
+        if (jobs->running == jobs->capacity || jobs->status != 0) {
+            break;
+        }
+        uintmax_t seq = jobs->chunk_seq + i;
+        struct chunk *chunk = chunk_at(jobs, seq);
+        if (!chunk->waiting || earlier(&now, &chunk->retry_at)) {
+            continue;
+        }
+        chunk->waiting = 0;
+        jobs->nb_waiting--;
+        if (start_chunk(jobs, free_slot(jobs), seq) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// retry_chunk releases the slot of a failed command, discarding its output,
+// and schedules its chunk to be sent again. The backoff starts at
+// backoff_min and doubles with each failure up to backoff_max.
+//
+// Returns 0 on success or -1 on error.
+int retry_chunk(struct jobs *jobs, struct job *job)
+{
+    struct chunk *chunk = chunk_at(jobs, job->input_seq);
+
+    drop_input(jobs, job);
+    if (job->in_fd != -1) {
+        close_job_fd(jobs, &job->in_fd);
+    }
+    if (job->out_fd != -1) {
+        close_job_fd(jobs, &job->out_fd);
+    }
+    if (jobs->out_owner == job) {
+        jobs->out_owner = NULL;
+    }
+    release_output(jobs, job);
+    job->failed = 0;
+    job->active = 0;
+    jobs->running--;
+
+    struct timeval delay = jobs->backoff_min;
+    for (size_t i = 0; i < chunk->attempts && earlier(&delay, &jobs->backoff_max); i++) {
+        add(&delay, &delay, &delay);
+    }
+    if (earlier(&jobs->backoff_max, &delay)) {
+        delay = jobs->backoff_max;
+    }
+
+    struct timeval now;
+    if (monoclock(&now) == -1) {
+        return -1;
+    }
+    add(&now, &delay, &chunk->retry_at);
+    chunk->attempts++;
+    chunk->waiting = 1;
+    jobs->nb_waiting++;
+    return 0;
+}
+
+// next_retry finds the earliest time a chunk waiting for retry is due.
+//
+// Returns 1 and assigns the time to *deadline if there is such a chunk, or 0.
+int next_retry(const struct jobs *jobs, struct timeval *deadline)
+{
+    int found = 0;
+    for (size_t i = 0; i < jobs->chunk_count && jobs->nb_waiting > 0; i++) {
+        const struct chunk *chunk = &jobs->chunks[(jobs->chunk_first + i) % jobs->chunk_cap];
+        if (chunk->waiting && (!found || earlier(&chunk->retry_at, deadline))) {
+            *deadline = chunk->retry_at;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+// start_workers starts all persistent workers up front.
+//
+// Returns 0 on success or -1 on error.
+int start_workers(struct jobs *jobs)
+{
+    for (size_t i = 0; i < jobs->capacity; i++) {
+        if (spawn_job(jobs, &jobs->slots[i], jobs->collect, 0, -1) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// pick_worker chooses the persistent worker for the next chunk. A worker is
+// ready when it is not writing the previous chunk. In round-robin mode the
+// workers take turns, so a busy worker holds up the rest. In least-loaded
+// mode the ready worker with the least unread data in its pipe is chosen,
+// with ties broken in round-robin order. A worker that has exited is started
+// again when chosen.
+//
+// Returns 0 on success or -1 on error. *worker is set to the worker, or NULL
+// if none is ready.
+int pick_worker(struct jobs *jobs, struct job **worker)
+{
+    struct job *best = NULL;
+    size_t best_index = 0;
+    size_t best_load = SIZE_MAX;
+
+    size_t nb_candidates = jobs->balance == balance_least_loaded ? jobs->capacity : 1;
+
+    for (size_t i = 0; i < nb_candidates; i++) {
+        size_t index = (jobs->next_worker + i) % jobs->capacity;
+        struct job *job = &jobs->slots[index];
+
+        // The slot of an exited worker has been released by settle_jobs().
+        size_t load = 0;
+        if (job->active) {
+            if (job->input_count > 0 || job->in_fd == -1) {
+                continue; // Busy, or closed its stdin and exiting.
+            }
+            if (nb_candidates > 1) {
+                load = pipe_load(job->in_fd);
+            }
+        }
+        if (load < best_load) {
+            best = job;
+            best_index = index;
+            best_load = load;
+        }
+        if (load == 0) {
+            break;
+        }
+    }
+
+    *worker = best;
+    if (best == NULL) {
+        return 0;
+    }
+    if (!best->active && spawn_job(jobs, best, jobs->collect, 0, -1) == -1) {
+        return -1;
+    }
+    jobs->next_worker = (best_index + 1) % jobs->capacity;
+    return 0;
+}
+
+// pipe_load gets the size of data in a pipe not read yet.
+//
+// Returns the size, or 0 if unknown.
+size_t pipe_load(int fd)
+{
+#if defined(FIONREAD)
+    int size;
+    if (ioctl(fd, FIONREAD, &size) == 0 && size > 0) {
+        return (size_t) size;
+    }
+#else
+    (void) fd;
+#endif
+    return 0;
+}
+
+// spawn_job starts a command in a free slot with non-blocking stdin. If
+// capture is non-zero, stdout of the command is captured. If in_file is not
+// -1, it becomes stdin of the command instead of a pipe, and its path for
+// {file}. Except in persistent mode, the command is for the queued chunk at
+// seq, whose metadata is substituted for placeholders in the arguments and
+// passed in XPIPE_* environment variables.
+//
+// Returns 0 on success or -1 on error.
+int spawn_job(struct jobs *jobs, struct job *job, int capture, uintmax_t seq, int in_file)
+{
+    int pipe_wr = -1;
+    int out_rd = -1;
+
+    struct command command = *jobs->command;
+    char **env = environ;
+    char *key_var = NULL;
+
+    // Each number is formatted after the name of its variable, which is the
+    // whole entry of the environment.
+    static const char *const names[] = {
+        "XPIPE_SEQ=", "XPIPE_BYTES=", "XPIPE_LINES=", "XPIPE_OFFSET=",
+    };
+    char vars[4][48];
+
+    if (!jobs->persistent) {
+        const struct chunk *chunk = chunk_at(jobs, seq);
+        const uintmax_t numbers[] = { seq, chunk->input_size, chunk->records, chunk->offset };
+        const char *values[nb_placeholders];
+        values[ph_key] = chunk->key;
+        values[ph_file] = in_file != -1 ? "/dev/stdin" : NULL;
+
+        env = chunk_env(jobs);
+        if (env == NULL) {
+            return fail(jobs, "xpipe: failed to allocate memory");
+        }
+        for (size_t i = 0; i < 4; i++) {
+            size_t name_len = strlen(names[i]);
+            memcpy(vars[i], names[i], name_len);
+            snprintf(vars[i] + name_len, sizeof vars[i] - name_len, "%ju", numbers[i]);
+            values[ph_seq + i] = vars[i] + name_len;
+            env[jobs->env_base + i] = vars[i];
+        }
+        if (chunk->key) {
+            key_var = malloc(strlen("XPIPE_KEY=") + strlen(chunk->key) + 1);
+            if (key_var == NULL) {
+                return fail(jobs, "xpipe: failed to allocate memory");
+            }
+            strcpy(key_var, "XPIPE_KEY=");
+            strcat(key_var, chunk->key);
+        }
+        env[jobs->env_base + 4] = key_var;
+
+        if (command.nb_parts > 0) {
+            command.argv = expand_args(jobs->command, values);
+            if (command.argv == NULL) {
+                free(key_var);
+                return fail(jobs, "xpipe: failed to allocate memory");
+            }
+        }
+    }
+
+    struct timeval spawned, started;
+    pid_t pid = -1;
+    if (monoclock(&spawned) == 0 && start_placement(jobs->placement) == 0) {
+        pid = open_pipe(&command, env, in_file, &pipe_wr, capture ? &out_rd : NULL);
+        if (end_placement(jobs->placement, pid) == -1 && pid != -1) {
+            add_job(jobs, job, pid, pipe_wr, out_rd);
+            return fail(jobs, "xpipe: failed to set priority of command");
+        }
+    }
+    if (command.argv != jobs->command->argv) {
+        free_args(jobs->command, command.argv);
+    }
+    free(key_var);
+    if (pid == -1) {
+        return fail(jobs, "xpipe: failed to start command");
+    }
+    add_job(jobs, job, pid, pipe_wr, out_rd);
+    if (monoclock(&started) == -1) {
+        return fail(jobs, "xpipe: failed to read clock");
+    }
+    job->started = started;
+    add_sample(&jobs->stats.spawn_us, elapsed_us(&spawned, &started));
+
+    if (pipe_wr != -1 && set_nonblock(pipe_wr) == -1) {
+        return fail(jobs, "xpipe: failed to write to pipe");
+    }
+    return 0;
+}
+
+// spawn_file_job writes a queued chunk to a new memory file, seals it and
+// starts a command with the file as stdin. The chunk is released right away
+// unless it may be retried.
+//
+// Returns 0 on success or -1 on error.
+int spawn_file_job(struct jobs *jobs, struct job *job, uintmax_t seq)
+{
+    struct chunk *chunk = chunk_at(jobs, seq);
+
+    int fd = open_chunk_file();
+    if (fd == -1) {
+        return fail(jobs, "xpipe: failed to create memory file");
+    }
+    if (write_all(fd, chunk->data, chunk->size) == -1 || seal_file(fd) == -1 ||
+        lseek(fd, 0, SEEK_SET) == -1) {
+        close_or_exit(fd, 1);
+        return fail(jobs, "xpipe: failed to write memory file");
+    }
+    jobs->stats.bytes_out += chunk->size;
+    int result = spawn_job(jobs, job, jobs->keep_order || jobs->collect, seq, fd);
+    close_or_exit(fd, 1);
+    if (jobs->retries == 0) {
+        chunk->written = 1;
+        release_chunks(jobs);
+    }
+    return result;
+}
+
+// start_input sets up writing of a queued chunk to the stdin of a command,
+// framed in persistent mode.
+void start_input(struct jobs *jobs, struct job *job, uintmax_t seq)
+{
+    const struct chunk *chunk = chunk_at(jobs, seq);
+    size_t count = 0;
+
+    if (jobs->persistent && jobs->frame == frame_u32be) {
+        job->header[0] = (unsigned char) (chunk->size >> 24);
+        job->header[1] = (unsigned char) (chunk->size >> 16);
+        job->header[2] = (unsigned char) (chunk->size >> 8);
+        job->header[3] = (unsigned char) chunk->size;
+        job->input[count++] = (struct span) { (const char *) job->header, sizeof job->header };
+    }
+
+    job->splice_span = count;
+    job->splice_size = 0;
+    job->input[count++] = (struct span) { chunk->data, chunk->size };
+
+#if defined(F_GETPIPE_SZ)
+    int capacity = fcntl(job->in_fd, F_GETPIPE_SZ);
+    if (capacity > 0 && chunk->size > (size_t) capacity) {
+        job->splice_size = chunk->size - (size_t) capacity;
+    }
+#endif
+
+    if (jobs->persistent && jobs->frame == frame_nul) {
+        job->input[count++] = (struct span) { "", 1 };
+    }
+    if (jobs->persistent && jobs->frame == frame_record) {
+        job->input[count++] = (struct span) { jobs->frame_record, strlen(jobs->frame_record) };
+        job->input[count++] = (struct span) { "\n", 1 };
+    }
+
+    job->input_index = 0;
+    job->input_count = count;
+    job->input_seq = seq;
+}
+
+// feed_job writes the input of a command to its non-blocking stdin as far as
+// the pipe accepts. The rest is written when wait_io() finds the pipe
+// writable, so that xpipe keeps reading input and handling outputs while a
+// command is slow to consume its input.
+//
+// Where available, the chunk is moved to the pipe with splice_some() except
+// for the last pipe-capacity bytes, which are copied with write(). The pipe
+// cannot hold more than its capacity, so once write() has put those bytes
+// in, the command has consumed all the spliced pages and the chunk can be
+// released.
+//
+// Returns 0 on success or -1 on error.
+int feed_job(struct jobs *jobs, struct job *job)
+{
+    if (job->input_count == 0) {
+        return 0;
+    }
+
+    while (job->input_index < job->input_count) {
+        struct span *span = &job->input[job->input_index];
+        if (span->size == 0) {
+            job->input_index++;
+            continue;
+        }
+
+        int splicing = job->input_index == job->splice_span && job->splice_size > 0;
+
+        ssize_t nb_written;
+        if (splicing) {
+            nb_written = splice_some(job->in_fd, span->data, job->splice_size);
+            if (nb_written == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                job->splice_size = 0; // Not supported. Fall back to write().
+                continue;
+            }
+        } else {
+            nb_written = write(job->in_fd, span->data, span->size);
+        }
+        if (nb_written == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EPIPE) {
+                // Command has closed its stdin. The rest is not needed.
+                drop_input(jobs, job);
+                close_job_fd(jobs, &job->in_fd);
+                return 0;
+            }
+            return fail(jobs, "xpipe: failed to write to pipe");
+        }
+
+        if (splicing) {
+            job->splice_size -= (size_t) nb_written;
+        }
+        jobs->stats.bytes_out += (uintmax_t) nb_written;
+        span->data += nb_written;
+        span->size -= (size_t) nb_written;
+    }
+
+    drop_input(jobs, job);
+    if (!jobs->persistent) {
+        close_job_fd(jobs, &job->in_fd);
+    }
+    return 0;
+}
+
+// drop_input ends writing the input of a command, whether written completely
+// or abandoned, and releases the chunk. With retries, the chunk is released
+// by settle_jobs() once the command succeeds instead.
+void drop_input(struct jobs *jobs, struct job *job)
+{
+    if (job->input_count == 0) {
+        return;
+    }
+    job->input_index = 0;
+    job->input_count = 0;
+    if (jobs->retries == 0) {
+        chunk_at(jobs, job->input_seq)->written = 1;
+        release_chunks(jobs);
+    }
+}
+
+// release_chunks removes written chunks from the head of the queue and
+// releases their space in the ring buffer. A chunk written out of order waits
+// for the preceding ones, since the ring buffer is released from the oldest.
+void release_chunks(struct jobs *jobs)
+{
+    while (jobs->chunk_count > jobs->chunk_pending) {
+        struct chunk *chunk = &jobs->chunks[jobs->chunk_first];
+        if (!chunk->written) {
+            break;
+        }
+        if (!chunk->buffer && !chunk->mapped && !chunk->in_mapping) {
+            release_ring(jobs->ring, chunk->size);
+        }
+        free_chunk(jobs, chunk);
+        jobs->chunk_first = (jobs->chunk_first + 1) % jobs->chunk_cap;
+        jobs->chunk_count--;
+        jobs->chunk_seq++;
+    }
+}
+
+// chunk_at looks up a queued chunk by sequence number.
+//
+// Returns a pointer to the chunk.
+struct chunk *chunk_at(struct jobs *jobs, uintmax_t seq)
+{
+    assert(seq >= jobs->chunk_seq && seq - jobs->chunk_seq < jobs->chunk_count);
+
+    size_t index = (size_t) (seq - jobs->chunk_seq);
+    return &jobs->chunks[(jobs->chunk_first + index) % jobs->chunk_cap];
+}
+
+// free_chunk releases the storage and the key owned by a chunk.
+void free_chunk(struct jobs *jobs, struct chunk *chunk)
+{
+    if (chunk->mapped) {
+        munmap((void *) chunk->data, chunk->size);
+    }
+    if (chunk->buffer) {
+        put_buffer(&jobs->pool, chunk->buffer, chunk->capacity);
+    }
+    free(chunk->key);
+}
+
+// compress_chunk replaces the data of a chunk with the compressed data in the
+// storage of the chunk.
+//
+// Returns 0 on success or -1 on error.
+int compress_chunk(struct jobs *jobs, struct chunk *chunk)
+{
+    size_t out_cap;
+    char *out = get_buffer(&jobs->pool,
+                           compress_bound(jobs->compress, jobs->compress_level, chunk->size),
+                           &out_cap);
+    if (out == NULL) {
+        return fail(jobs, "xpipe: failed to allocate memory");
+    }
+    size_t out_size;
+    if (compress_data(jobs->compress, jobs->compress_level, chunk->data, chunk->size,
+                      out, out_cap, &out_size) == -1) {
+        put_buffer(&jobs->pool, out, out_cap);
+        return fail(jobs, "xpipe: failed to compress chunk");
+    }
+    replace_data(jobs, chunk, out, out_cap, out_size);
+    return 0;
+}
+
+// compress_queued compresses a chunk just queued, in a compressor thread if
+// any or right away.
+//
+// Returns 0 on success or -1 on error.
+int compress_queued(struct jobs *jobs, struct chunk *chunk)
+{
+    if (jobs->nb_compressors > 0) {
+        return submit_chunk(jobs, chunk);
+    }
+    return compress_chunk(jobs, chunk);
+}
+
+// replace_data gives a chunk new data in its own storage from the pool.
+// Storage the chunk had before is freed, or released to the ring buffer.
+void replace_data(struct jobs *jobs, struct chunk *chunk, char *out, size_t out_cap, size_t out_size)
+{
+    if (chunk->buffer) {
+        put_buffer(&jobs->pool, chunk->buffer, chunk->capacity);
+    } else if (chunk->mapped) {
+        munmap((void *) chunk->data, chunk->size);
+        chunk->mapped = 0;
+    } else if (chunk->in_mapping) {
+        chunk->in_mapping = 0;
+    } else {
+        release_ring(jobs->ring, chunk->size);
+    }
+    chunk->buffer = out;
+    chunk->capacity = out_cap;
+    chunk->data = out;
+    chunk->size = out_size;
+}
+
+// compress_bound gets the largest possible size of compressed data.
+//
+// Returns the size.
+size_t compress_bound(int method, int level, size_t size)
+{
+    (void) level;
+
+    switch (method) {
+#if defined(HAVE_ZLIB)
+      case compress_gzip:
+        // compressBound() is for the zlib wrapper, which is 12 bytes shorter
+        // than the gzip one.
+        return (size_t) compressBound((uLong) size) + 12;
+#endif
+
+#if defined(HAVE_ZSTD)
+      case compress_zstd:
+        return ZSTD_compressBound(size);
+#endif
+
+#if defined(HAVE_LZ4)
+      case compress_lz4: {
+        LZ4F_preferences_t preferences;
+        memset(&preferences, 0, sizeof preferences);
+        preferences.compressionLevel = level;
+        preferences.frameInfo.contentSize = size;
+        return LZ4F_compressFrameBound(size, &preferences);
+      }
+#endif
+
+      default:
+        (void) size;
+        return 1;
+    }
+}
+
+// compress_data compresses data into a gzip member, zstd frame or LZ4 frame as
+// a whole. out must have room for compress_bound() bytes. The function does
+// not allocate buffers, so it may run in any thread.
+//
+// Returns 0 on success or -1 on error. The size of the compressed data is
+// assigned to *out_size on success.
+int compress_data(int method, int level, const char *buf, size_t size, char *out, size_t out_cap,
+                  size_t *out_size)
+{
+    // Unused if no compression library is compiled in.
+    (void) level;
+    (void) buf;
+    (void) size;
+    (void) out;
+    (void) out_cap;
+
+    size_t result_size = 0;
+
+    switch (method) {
+#if defined(HAVE_ZLIB)
+      case compress_gzip: {
+        z_stream stream;
+        memset(&stream, 0, sizeof stream);
+        if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        // zlib counts in uInt. Feed large data by pieces.
+        size_t in_left = size;
+        stream.next_in = (const Bytef *) buf;
+        stream.next_out = (Bytef *) out;
+        for (;;) {
+            if (stream.avail_in == 0 && in_left > 0) {
+                size_t piece = in_left < UINT_MAX ? in_left : UINT_MAX;
+                stream.avail_in = (uInt) piece;
+                in_left -= piece;
+            }
+            size_t out_left = out_cap - (size_t) ((char *) stream.next_out - out);
+            stream.avail_out = (uInt) (out_left < UINT_MAX ? out_left : UINT_MAX);
+
+            int ret = deflate(&stream, in_left == 0 ? Z_FINISH : Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                break;
+            }
+            if (ret != Z_OK && !(ret == Z_BUF_ERROR && out_left > 0)) {
+                deflateEnd(&stream);
+                errno = EINVAL;
+                return -1;
+            }
+        }
+        result_size = (size_t) ((char *) stream.next_out - out);
+        deflateEnd(&stream);
+        break;
+      }
+#endif
+
+#if defined(HAVE_ZSTD)
+      case compress_zstd:
+        result_size = ZSTD_compress(out, out_cap, buf, size, level);
+        if (ZSTD_isError(result_size)) {
+            errno = EINVAL;
+            return -1;
+        }
+        break;
+#endif
+
+#if defined(HAVE_LZ4)
+      case compress_lz4: {
+        LZ4F_preferences_t preferences;
+        memset(&preferences, 0, sizeof preferences);
+        preferences.compressionLevel = level;
+        preferences.frameInfo.contentSize = size;
+
+        result_size = LZ4F_compressFrame(out, out_cap, buf, size, &preferences);
+        if (LZ4F_isError(result_size)) {
+            errno = EINVAL;
+            return -1;
+        }
+        break;
+      }
+#endif
+
+      default:
+        assert(0);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    *out_size = result_size;
+    return 0;
+}
+
+// start_compressors starts compressor threads with all signals blocked, so
+// that signals are delivered to the main thread.
+//
+// Returns 0 on success or -1 on error.
+int start_compressors(struct jobs *jobs, size_t count)
+{
+    jobs->compressors = calloc(count, sizeof *jobs->compressors);
+    if (jobs->compressors == NULL) {
+        return -1;
+    }
+    if (pipe(jobs->compress_notify) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (set_nonblock(jobs->compress_notify[i]) == -1 ||
+            set_cloexec(jobs->compress_notify[i]) == -1) {
+            return -1;
+        }
+    }
+
+    sigset_t all;
+    sigset_t saved;
+    sigfillset(&all);
+    int err = pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+    for (size_t i = 0; i < count && err == 0; i++) {
+        struct compressor *compressor = &jobs->compressors[i];
+        compressor->notify_fd = jobs->compress_notify[1];
+        compressor->method = jobs->compress;
+        compressor->level = jobs->compress_level;
+        if (pipe(compressor->wake) == -1 || set_cloexec(compressor->wake[0]) == -1 ||
+            set_cloexec(compressor->wake[1]) == -1) {
+            err = errno;
+            break;
+        }
+        err = pthread_create(&compressor->thread, NULL, run_compressor, compressor);
+        if (err == 0) {
+            jobs->nb_compressors++;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// stop_compressors lets compressor threads finish their tasks and exit, and
+// frees results not collected. It is called before the pool is freed.
+void stop_compressors(struct jobs *jobs)
+{
+    for (size_t i = 0; i < jobs->nb_compressors; i++) {
+        struct compressor *compressor = &jobs->compressors[i];
+        close_or_exit(compressor->wake[1], 1);
+        pthread_join(compressor->thread, NULL);
+        close_or_exit(compressor->wake[0], 1);
+        for (size_t j = compressor->collected; j < compressor->done; j++) {
+            struct task *task = &compressor->tasks[j % 16];
+            put_buffer(&jobs->pool, task->out, task->out_cap);
+        }
+    }
+    if (jobs->compress_notify[0] != -1) {
+        close_or_exit(jobs->compress_notify[0], 1);
+        close_or_exit(jobs->compress_notify[1], 1);
+    }
+    free(jobs->compressors);
+    jobs->compressors = NULL;
+    jobs->nb_compressors = 0;
+}
+
+// run_compressor is the body of a compressor thread. It compresses tasks in
+// order until the wake pipe is closed.
+void *run_compressor(void *arg)
+{
+    struct compressor *compressor = arg;
+    const size_t capacity = sizeof compressor->tasks / sizeof compressor->tasks[0];
+
+    for (;;) {
+        size_t tail = __atomic_load_n(&compressor->tail, __ATOMIC_ACQUIRE);
+        if (compressor->done == tail) {
+            char drain[64];
+            ssize_t nb_read = read(compressor->wake[0], drain, sizeof drain);
+            if (nb_read == 0) {
+                break;
+            }
+            continue; // Awoken, or interrupted.
+        }
+
+        struct task *task = &compressor->tasks[compressor->done % capacity];
+        task->result = compress_data(compressor->method, compressor->level, task->data,
+                                     task->size, task->out, task->out_cap, &task->out_size);
+        __atomic_store_n(&compressor->done, compressor->done + 1, __ATOMIC_RELEASE);
+
+        // A full pipe has notifications pending already.
+        ssize_t nb_written = write(compressor->notify_fd, "", 1);
+        (void) nb_written;
+    }
+    return NULL;
+}
+
+// submit_chunk hands a chunk to the next compressor thread in turn, waiting
+// for a free slot if its ring of tasks is full. The chunk is not sent to
+// commands until collected.
+//
+// Returns 0 on success or -1 on error.
+int submit_chunk(struct jobs *jobs, struct chunk *chunk)
+{
+    struct compressor *compressor = &jobs->compressors[jobs->next_task % jobs->nb_compressors];
+    const size_t capacity = sizeof compressor->tasks / sizeof compressor->tasks[0];
+
+    // Counted first so that the chunk is not sent while waiting.
+    jobs->nb_compressing++;
+
+    while (compressor->tail - compressor->collected == capacity) {
+        if (wait_io(jobs, -1, NULL) == -1 && errno != EINTR) {
+            return -1;
+        }
+        if (jobs->status != 0) {
+            return 0;
+        }
+    }
+
+    // The pool is used by the main thread only. Output buffers are taken here.
+    struct task *task = &compressor->tasks[compressor->tail % capacity];
+    task->out = get_buffer(&jobs->pool,
+                           compress_bound(jobs->compress, jobs->compress_level, chunk->size),
+                           &task->out_cap);
+    if (task->out == NULL) {
+        return fail(jobs, "xpipe: failed to allocate memory");
+    }
+    task->data = chunk->data;
+    task->size = chunk->size;
+    __atomic_store_n(&compressor->tail, compressor->tail + 1, __ATOMIC_RELEASE);
+    jobs->next_task++;
+
+    if (write_all(compressor->wake[1], "", 1) == -1) {
+        return fail(jobs, "xpipe: failed to wake up thread");
+    }
+    return 0;
+}
+
+// collect_chunks takes the results of compressor threads in queue order, as
+// far as they are done, and gives them to their chunks.
+//
+// Returns 0 on success or -1 on error.
+int collect_chunks(struct jobs *jobs)
+{
+    char drain[64];
+    while (read(jobs->compress_notify[0], drain, sizeof drain) > 0) {
+        // Discard notifications; the indices tell which tasks are done.
+    }
+
+    while (jobs->nb_compressing > 0) {
+        struct compressor *compressor =
+            &jobs->compressors[jobs->next_result % jobs->nb_compressors];
+        const size_t capacity = sizeof compressor->tasks / sizeof compressor->tasks[0];
+
+        if (compressor->collected == __atomic_load_n(&compressor->done, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        struct task *task = &compressor->tasks[compressor->collected % capacity];
+        compressor->collected++;
+        jobs->next_result++;
+        jobs->nb_compressing--;
+
+        if (task->result == -1) {
+            put_buffer(&jobs->pool, task->out, task->out_cap);
+            return fail(jobs, "xpipe: failed to compress chunk");
+        }
+        uintmax_t seq = jobs->chunk_seq + (jobs->chunk_count - jobs->nb_compressing - 1);
+        replace_data(jobs, chunk_at(jobs, seq), task->out, task->out_cap, task->out_size);
+    }
+    return 0;
+}
+
+// route_lines appends lines to the batches of their keys. A batch is sent when
+// it reaches the chunk size or number of lines, or before it would exceed the
+// chunk size. The data may end with a line without newline.
+//
+// Returns 0 on success or -1 on error.
+int route_lines(struct jobs *jobs, struct shards *shards, const struct config *config,
+                const char *buf, size_t size, const struct timeval *now)
+{
+    const size_t limit = chunk_limit(config, jobs);
+
+    while (size > 0) {
+        ssize_t end = end_of_record(&config->record, buf, size, 0, 0);
+        size_t line_size = end != -1 ? (size_t) end : size;
+
+        size_t payload_size;
+        const char *payload = record_payload(&config->record, buf, line_size, &payload_size);
+        size_t key_size;
+        const char *key = extract_key(&config->key, payload, payload_size, &key_size);
+
+        struct shard *shard = get_shard(shards, key, key_size, now);
+        if (shard && shard->size > 0 && shard->size + line_size > limit) {
+            if (send_shard(jobs, shards, shard, flush_size) == -1) {
+                return -1;
+            }
+            shard = get_shard(shards, key, key_size, now);
+        }
+        if (shard == NULL || append_line(shard, &jobs->pool, buf, line_size) == -1) {
+            return fail(jobs, "xpipe: failed to allocate memory");
+        }
+        shards->size += line_size;
+
+        if (shard->size >= limit ||
+            (config->batch_lines > 0 && shard->lines == config->batch_lines)) {
+            int reason = shard->size >= limit ? flush_size : flush_count;
+            if (send_shard(jobs, shards, shard, reason) == -1) {
+                return -1;
+            }
+        }
+
+        buf += line_size;
+        size -= line_size;
+    }
+    return 0;
+}
+
+// send_shard queues the batch of a shard as a chunk, which takes over the
+// storage, and removes the shard. reason is counted in the statistics.
+//
+// Returns 0 on success or -1 on error.
+int send_shard(struct jobs *jobs, struct shards *shards, struct shard *shard, int reason)
+{
+    note_chunk(&jobs->stats, reason, shard->size, shard->lines);
+
+    struct chunk *chunk = queue_chunk(jobs, shard->buf, shard->size);
+    if (chunk == NULL) {
+        return -1;
+    }
+    chunk->buffer = shard->buf;
+    chunk->capacity = shard->capacity;
+    chunk->key = shard->key;
+    shards->size -= shard->size;
+    remove_shard(shards, shard);
+
+    if (jobs->compress != compress_none && compress_queued(jobs, chunk) == -1) {
+        return -1;
+    }
+    return start_jobs(jobs);
+}
+
+// send_overdue sends the batches whose first line arrived delay or longer ago.
+//
+// Returns 0 on success or -1 on error.
+int send_overdue(struct jobs *jobs, struct shards *shards, const struct timeval *delay,
+                 const struct timeval *now, int reason)
+{
+    while (shards->oldest) {
+        struct timeval deadline;
+        add(&shards->oldest->first, delay, &deadline);
+        if (earlier(now, &deadline)) {
+            break;
+        }
+        if (send_shard(jobs, shards, shards->oldest, reason) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// send_shards sends all batches, oldest first.
+//
+// Returns 0 on success or -1 on error.
+int send_shards(struct jobs *jobs, struct shards *shards, int reason)
+{
+    while (shards->oldest) {
+        if (send_shard(jobs, shards, shards->oldest, reason) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// extract_key finds the key in the payload of a record, without its delimiter
+// or length prefix. A missing field or byte range gives an empty key.
+//
+// Returns a pointer to the key in line and assigns its size to *key_size.
+const char *extract_key(const struct key_spec *spec, const char *line, size_t size, size_t *key_size)
+{
+    const char *end = line + size;
+
+    if (spec->type == key_bytes) {
+        if (spec->first > size) {
+            *key_size = 0;
+            return end;
+        }
+        size_t last = spec->last < size ? spec->last : size;
+        *key_size = last - spec->first + 1;
+        return line + spec->first - 1;
+    }
+
+    const char *pos = line;
+    for (size_t field = 1; field < spec->first; field++) {
+        const char *delim = memchr(pos, spec->delim, (size_t) (end - pos));
+        if (delim == NULL) {
+            *key_size = 0;
+            return end;
+        }
+        pos = delim + 1;
+    }
+    const char *delim = memchr(pos, spec->delim, (size_t) (end - pos));
+    *key_size = (size_t) ((delim ? delim : end) - pos);
+    return pos;
+}
+
+// hash_key calculates the FNV-1a hash of a key.
+size_t hash_key(const char *key, size_t size)
+{
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= UINT64_C(1099511628211);
+    }
+    return (size_t) hash;
+}
+
+// init_shards creates an empty table of shards.
+//
+// Returns 0 on success or -1 on error.
+int init_shards(struct shards *shards)
+{
+    shards->nb_buckets = 64;
+    shards->buckets = calloc(shards->nb_buckets, sizeof *shards->buckets);
+    shards->count = 0;
+    shards->size = 0;
+    shards->oldest = NULL;
+    shards->newest = NULL;
+    return shards->buckets ? 0 : -1;
+}
+
+// free_shards releases a table of shards, returning the batches to the pool.
+void free_shards(struct shards *shards, struct pool *pool)
+{
+    while (shards->oldest) {
+        struct shard *shard = shards->oldest;
+        if (shard->buf) {
+            put_buffer(pool, shard->buf, shard->capacity);
+        }
+        free(shard->key);
+        remove_shard(shards, shard);
+    }
+    free(shards->buckets);
+}
+
+// get_shard finds the shard of a key, or adds one if none. now is the arrival
+// time of the first line of a new shard.
+//
+// Returns a pointer to the shard or NULL on error.
+struct shard *get_shard(struct shards *shards, const char *key, size_t key_size,
+                        const struct timeval *now)
+{
+    size_t hash = hash_key(key, key_size);
+
+    for (struct shard *shard = shards->buckets[hash % shards->nb_buckets]; shard; shard = shard->chain) {
+        if (shard->hash == hash && shard->key_size == key_size &&
+            memcmp(shard->key, key, key_size) == 0) {
+            return shard;
+        }
+    }
+
+    if (shards->count >= shards->nb_buckets && grow_shards(shards) == -1) {
+        return NULL;
+    }
+
+    struct shard *shard = calloc(1, sizeof *shard);
+    if (shard == NULL) {
+        return NULL;
+    }
+    shard->key = malloc(key_size + 1);
+    if (shard->key == NULL) {
+        free(shard);
+        return NULL;
+    }
+    memcpy(shard->key, key, key_size);
+    shard->key[key_size] = '\0';
+    shard->key_size = key_size;
+    shard->hash = hash;
+    shard->first = *now;
+
+    struct shard **bucket = &shards->buckets[hash % shards->nb_buckets];
+    shard->chain = *bucket;
+    *bucket = shard;
+
+    shard->prev = shards->newest;
+    if (shards->newest) {
+        shards->newest->next = shard;
+    } else {
+        shards->oldest = shard;
+    }
+    shards->newest = shard;
+    shards->count++;
+    return shard;
+}
+
+// grow_shards doubles the number of buckets of a table of shards.
+//
+// Returns 0 on success or -1 on error.
+int grow_shards(struct shards *shards)
+{
+    size_t nb_buckets = shards->nb_buckets * 2;
+    struct shard **buckets = calloc(nb_buckets, sizeof *buckets);
+    if (buckets == NULL) {
+        return -1;
+    }
+    for (struct shard *shard = shards->oldest; shard; shard = shard->next) {
+        struct shard **bucket = &buckets[shard->hash % nb_buckets];
+        shard->chain = *bucket;
+        *bucket = shard;
+    }
+    free(shards->buckets);
+    shards->buckets = buckets;
+    shards->nb_buckets = nb_buckets;
+    return 0;
+}
+
+// remove_shard unlinks a shard from a table and frees it. The key and batch
+// are left to the caller.
+void remove_shard(struct shards *shards, struct shard *shard)
+{
+    struct shard **link = &shards->buckets[shard->hash % shards->nb_buckets];
+    while (*link != shard) {
+        link = &(*link)->chain;
+    }
+    *link = shard->chain;
+
+    if (shard->prev) {
+        shard->prev->next = shard->next;
+    } else {
+        shards->oldest = shard->next;
+    }
+    if (shard->next) {
+        shard->next->prev = shard->prev;
+    } else {
+        shards->newest = shard->prev;
+    }
+    shards->count--;
+    free(shard);
+}
+
+// append_line adds a line to the batch of a shard, growing the storage as
+// needed.
+//
+// Returns 0 on success or -1 on error.
+int append_line(struct shard *shard, struct pool *pool, const char *line, size_t size)
+{
+    if (shard->size + size > shard->capacity) {
+        size_t capacity;
+        char *buf = get_buffer(pool, shard->size + size, &capacity);
+        if (buf == NULL) {
+            return -1;
+        }
+        if (shard->buf) {
+            memcpy(buf, shard->buf, shard->size);
+            put_buffer(pool, shard->buf, shard->capacity);
+        }
+        shard->buf = buf;
+        shard->capacity = capacity;
+    }
+    memcpy(shard->buf + shard->size, line, size);
+    shard->size += size;
+    shard->lines++;
+    return 0;
+}
+
+// parse_template splits the arguments of a command containing placeholders
+// into parts. The program name is never substituted.
+//
+// Returns 0 on success or -1 on error.
+int parse_template(struct command *command)
+{
+    static const char *const names[nb_placeholders + 1] = {
+        [ph_key]    = "{key}",
+        [ph_file]   = "{file}",
+        [ph_seq]    = "{seq}",
+        [ph_bytes]  = "{bytes}",
+        [ph_lines]  = "{lines}",
+        [ph_offset] = "{offset}",
+        [nb_placeholders] = "{}",   // short for {key}
+    };
+
+    for (size_t i = 1; command->argv[i]; i++) {
+        const char *arg = command->argv[i];
+        const char *literal = arg;
+
+        for (const char *pos = strchr(arg, '{'); pos; pos = strchr(pos, '{')) {
+            int placeholder = -1;
+            size_t name_len = 0;
+            for (int ph = 0; ph <= nb_placeholders; ph++) {
+                name_len = strlen(names[ph]);
+                if (strncmp(pos, names[ph], name_len) == 0) {
+                    placeholder = ph < nb_placeholders ? ph : ph_key;
+                    break;
+                }
+            }
+            if (placeholder == -1) {
+                pos++;
+                continue;
+            }
+
+            struct arg_part *parts = realloc(command->parts, (command->nb_parts + 2) * sizeof *parts);
+            if (parts == NULL) {
+                return -1;
+            }
+            command->parts = parts;
+            if (pos > literal) {
+                parts[command->nb_parts++] = (struct arg_part) { i, literal, (size_t) (pos - literal), -1 };
+            }
+            parts[command->nb_parts++] = (struct arg_part) { i, pos, name_len, placeholder };
+            pos += name_len;
+            literal = pos;
+        }
+
+        if (literal != arg && *literal != '\0') {
+            struct arg_part *parts = realloc(command->parts, (command->nb_parts + 1) * sizeof *parts);
+            if (parts == NULL) {
+                return -1;
+            }
+            command->parts = parts;
+            parts[command->nb_parts++] = (struct arg_part) { i, literal, strlen(literal), -1 };
+        }
+    }
+    return 0;
+}
+
+// expand_args copies the argument vector of a command, building the arguments
+// with placeholders from the values indexed by placeholder. A placeholder
+// without value is left as is. The other arguments are shared with the
+// command.
+//
+// Returns a newly allocated argument vector or NULL on error.
+char **expand_args(const struct command *command, const char *const *values)
+{
+    size_t argc = 0;
+    while (command->argv[argc]) {
+        argc++;
+    }
+
+    char **args = malloc((argc + 1) * sizeof *args);
+    if (args == NULL) {
+        return NULL;
+    }
+    memcpy(args, command->argv, (argc + 1) * sizeof *args);
+
+    for (size_t first = 0; first < command->nb_parts; ) {
+        size_t arg = command->parts[first].arg;
+        size_t end = first;
+        size_t len = 0;
+        for (; end < command->nb_parts && command->parts[end].arg == arg; end++) {
+            const struct arg_part *part = &command->parts[end];
+            const char *value = part->placeholder == -1 ? NULL : values[part->placeholder];
+            len += value ? strlen(value) : part->size;
+        }
+
+        char *str = malloc(len + 1);
+        if (str == NULL) {
+            free_args(command, args);
+            return NULL;
+        }
+        char *out = str;
+        for (size_t i = first; i < end; i++) {
+            const struct arg_part *part = &command->parts[i];
+            const char *value = part->placeholder == -1 ? NULL : values[part->placeholder];
+            size_t size = value ? strlen(value) : part->size;
+            memcpy(out, value ? value : part->text, size);
+            out += size;
+        }
+        *out = '\0';
+        args[arg] = str;
+        first = end;
+    }
+    return args;
+}
+
+// free_args releases an argument vector made by expand_args().
+void free_args(const struct command *command, char **args)
+{
+    for (size_t i = 0; args[i]; i++) {
+        if (args[i] != command->argv[i]) {
+            free(args[i]);
+        }
+    }
+    free(args);
+}
+
+// chunk_env returns the environment for commands, copied from that of xpipe
+// on first use without XPIPE_* variables. Five slots at env_base are left for
+// XPIPE_SEQ, XPIPE_BYTES, XPIPE_LINES, XPIPE_OFFSET and XPIPE_KEY, followed
+// by NULL, to be filled for each command.
+//
+// Returns the environment or NULL on error.
+char **chunk_env(struct jobs *jobs)
+{
+    if (jobs->env) {
+        return jobs->env;
+    }
+
+    size_t count = 0;
+    while (environ[count]) {
+        count++;
+    }
+    char **env = malloc((count + 6) * sizeof *env);
+    if (env == NULL) {
+        return NULL;
+    }
+    size_t base = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], "XPIPE_", strlen("XPIPE_")) != 0) {
+            env[base++] = environ[i];
+        }
+    }
+    for (size_t i = base; i < base + 6; i++) {
+        env[i] = NULL;
+    }
+    jobs->env = env;
+    jobs->env_base = base;
+    return env;
+}
+
+// available_cpus finds the number of CPUs commands may use: those in --cpus or
+// the affinity of xpipe, limited by the CPU quota of the cgroup of xpipe.
+//
+// Returns the number of CPUs, at least one.
+size_t available_cpus(const struct placement *placement)
+{
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = online > 0 ? (size_t) online : 1;
+#if defined(HAVE_SCHED_AFFINITY)
+    int in_set = CPU_COUNT(placement->has_cpus ? &placement->cpus : &placement->own_cpus);
+    if (in_set > 0 && (size_t) in_set < count) {
+        count = (size_t) in_set;
+    }
+#else
+    (void) placement;
+#endif
+    size_t quota = cgroup_cpus();
+    if (quota > 0 && quota < count) {
+        count = quota;
+    }
+    return count;
+}
+
+// cgroup_cpus reads the CPU quota of the cgroup of xpipe and its ancestors,
+// from cpu.max of cgroup v2 or cpu.cfs_quota_us of cgroup v1, rounded up to
+// whole CPUs.
+//
+// Returns the smallest quota found, or 0 if there is none.
+size_t cgroup_cpus(void)
+{
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    size_t result = 0;
+    char line[4096];
+    while (fgets(line, sizeof line, file)) {
+        line[strcspn(line, "\n")] = '\0';
+
+        // Lines are "0::PATH" for v2 or "ID:CONTROLLERS:PATH" for v1.
+        char *controllers = strchr(line, ':');
+        char *path = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (path == NULL) {
+            continue;
+        }
+        *path++ = '\0';
+        controllers++;
+
+        const char *root;
+        int v2 = *controllers == '\0';
+        if (v2) {
+            root = "/sys/fs/cgroup";
+        } else if (strstr(controllers, "cpu,cpuacct") || strstr(controllers, "cpuacct,cpu")) {
+            root = "/sys/fs/cgroup/cpu,cpuacct";
+        } else if (strcmp(controllers, "cpu") == 0 || strncmp(controllers, "cpu,", 4) == 0) {
+            root = "/sys/fs/cgroup/cpu";
+        } else {
+            continue;
+        }
+
+        // The quota may be set on any ancestor. Inside a cgroup namespace the
+        // path is "/" and the root holds the quota of the container.
+        for (;;) {
+            size_t quota = read_quota(root, path, v2);
+            if (quota > 0 && (result == 0 || quota < result)) {
+                result = quota;
+            }
+            char *slash = strrchr(path, '/');
+            if (slash == NULL || (slash == path && path[1] == '\0')) {
+                break;
+            }
+            slash[slash == path ? 1 : 0] = '\0';
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+// read_quota reads the CPU quota of a cgroup at path under root.
+//
+// Returns the quota rounded up to whole CPUs, or 0 if there is none.
+size_t read_quota(const char *root, const char *path, int v2)
+{
+    char name[4096 + 64];
+    long long quota = -1;
+    long long period = 0;
+
+    if (v2) {
+        snprintf(name, sizeof name, "%s%s/cpu.max", root, path);
+        FILE *file = fopen(name, "r");
+        if (file == NULL) {
+            return 0;
+        }
+        if (fscanf(file, "%lld %lld", &quota, &period) != 2) {
+            quota = -1; // "max"
+        }
+        fclose(file);
+    } else {
+        const char *leaves[] = { "cpu.cfs_quota_us", "cpu.cfs_period_us" };
+        long long *values[] = { &quota, &period };
+        for (size_t i = 0; i < 2; i++) {
+            snprintf(name, sizeof name, "%s%s/%s", root, path, leaves[i]);
+            FILE *file = fopen(name, "r");
+            if (file == NULL) {
+                return 0;
+            }
+            if (fscanf(file, "%lld", values[i]) != 1) {
+                *values[i] = -1;
+            }
+            fclose(file);
+        }
+    }
+
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+    return (size_t) ((quota + period - 1) / period);
+}
+
+// start_placement applies the CPU set of commands to the calling thread, so
+// that the next command spawned inherits it.
+//
+// Returns 0 on success or -1 on error.
+int start_placement(const struct placement *placement)
+{
+#if defined(HAVE_SCHED_AFFINITY)
+    if (placement->has_cpus) {
+        return sched_setaffinity(0, sizeof placement->cpus, &placement->cpus);
+    }
+#else
+    (void) placement;
+#endif
+    return 0;
+}
+
+// end_placement restores the CPU set of the calling thread, and lowers the
+// CPU and I/O priority of a command just spawned, unless it has already
+// exited.
+//
+// Returns 0 on success or -1 on error.
+int end_placement(const struct placement *placement, pid_t pid)
+{
+#if defined(HAVE_SCHED_AFFINITY)
+    if (placement->has_cpus &&
+        sched_setaffinity(0, sizeof placement->own_cpus, &placement->own_cpus) == -1) {
+        return -1;
+    }
+#endif
+    if (pid == -1) {
+        return 0;
+    }
+    if (placement->has_nice && setpriority(PRIO_PROCESS, (id_t) pid, placement->nice) == -1 &&
+        errno != ESRCH) {
+        return -1;
+    }
+#if defined(HAVE_IOPRIO)
+    if (placement->ioprio != -1 &&
+        syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, (int) pid, placement->ioprio) == -1 &&
+        errno != ESRCH) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+// open_pipe launches a command with stdin bound to a new pipe, or to in_file
+// if it is not -1. If out_fd is not NULL, stdout of the command is also bound
+// to a new pipe.
+//
+// The command is spawned with posix_spawn() so that the cost does not grow
+// with the memory size of xpipe, as fork() copying page tables would.
+//
+// Returns the PID of the command process and assigns the write end of the
+// stdin pipe, or -1 with in_file, to *fd (and the read end of the stdout pipe
+// to *out_fd) on success. Returns -1 on error.
+pid_t open_pipe(const struct command *command, char **env, int in_file, int *fd, int *out_fd)
+{
+    int fds[2];
+    int pipe_rd = in_file;
+    int pipe_wr = -1;
+    if (in_file == -1) {
+        if (pipe(fds) == -1) {
+            return -1;
+        }
+        pipe_rd = fds[0];
+        pipe_wr = fds[1];
+    }
+
+    int out_rd = -1;
+    int out_wr = -1;
+    if (out_fd) {
+        if (pipe(fds) == -1) {
+            if (in_file == -1) {
+                close_or_exit(pipe_rd, 1);
+                close_or_exit(pipe_wr, 1);
+            }
+            return -1;
+        }
+        out_rd = fds[0];
+        out_wr = fds[1];
+    }
+
+    // Other commands started later must not inherit our ends of the pipes.
+    // Otherwise the command would not see EOF until all of them exit.
+    int err = 0;
+    if ((pipe_wr != -1 && set_cloexec(pipe_wr) == -1) || (out_fd && set_cloexec(out_rd) == -1)) {
+        err = errno;
+    }
+
+    posix_spawn_file_actions_t actions;
+    if (err == 0) {
+        err = posix_spawn_file_actions_init(&actions);
+    }
+    if (err == 0) {
+        err = posix_spawn_file_actions_adddup2(&actions, pipe_rd, STDIN_FILENO);
+        if (err == 0) {
+            err = posix_spawn_file_actions_addclose(&actions, pipe_rd);
+        }
+        if (err == 0 && out_fd) {
+            err = posix_spawn_file_actions_adddup2(&actions, out_wr, STDOUT_FILENO);
+            if (err == 0) {
+                err = posix_spawn_file_actions_addclose(&actions, out_wr);
+            }
+        }
+
+        // SIGPIPE is ignored by xpipe. Commands get the default action back.
+        posix_spawnattr_t attr;
+        int has_attr = 0;
+        if (err == 0) {
+            err = posix_spawnattr_init(&attr);
+            has_attr = err == 0;
+        }
+        if (err == 0) {
+            sigset_t sigdefault;
+            sigemptyset(&sigdefault);
+            sigaddset(&sigdefault, SIGPIPE);
+            err = posix_spawnattr_setsigdefault(&attr, &sigdefault);
+        }
+        if (err == 0) {
+            err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+        }
+
+        pid_t pid;
+        if (err == 0) {
+            err = posix_spawn(&pid, command->path, &actions, &attr, command->argv, env);
+        }
+        if (has_attr) {
+            posix_spawnattr_destroy(&attr);
+        }
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (err == 0) {
+            if (in_file == -1) {
+                close_or_exit(pipe_rd, 1);
+            }
+            *fd = pipe_wr;
+
+            if (out_fd) {
+                close_or_exit(out_wr, 1);
+                *out_fd = out_rd;
+            }
+            return pid;
+        }
+    }
+
+    if (in_file == -1) {
+        close_or_exit(pipe_rd, 1);
+        close_or_exit(pipe_wr, 1);
+    }
+    if (out_fd) {
+        close_or_exit(out_rd, 1);
+        close_or_exit(out_wr, 1);
+    }
+    errno = err;
+    return -1;
+}
+
+// find_program searches PATH for an executable file in the same way as
+// execvp(). name is used as is if it contains a slash.
+//
+// Returns a newly allocated path to the program or NULL if not found.
+char *find_program(const char *name)
+{
+    if (strchr(name, '/')) {
+        return strdup(name);
+    }
+
+    const char *path = getenv("PATH");
+    if (path == NULL) {
+        path = "/bin:/usr/bin";
+    }
+
+    size_t name_len = strlen(name);
+
+    for (;;) {
+        const char *end = strchr(path, ':');
+        size_t dir_len = end ? (size_t) (end - path) : strlen(path);
+
+        // An empty entry denotes the current directory.
+        char *candidate = malloc(dir_len + name_len + 2);
+        if (candidate == NULL) {
+            return NULL;
+        }
+        if (dir_len == 0) {
+            memcpy(candidate, name, name_len + 1);
+        } else {
+            memcpy(candidate, path, dir_len);
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, name, name_len + 1);
+        }
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+
+        if (end == NULL) {
+            break;
+        }
+        path = end + 1;
+    }
+
+    return NULL;
+}
+
+// write_all writes data to a file, handling potential partial writes.
+//
+// Returns 0 on success or -1 on error.
+int write_all(int fd, const char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t nb_written = write(fd, buf, size);
+        if (nb_written == -1) {
+            return -1;
+        }
+        buf += nb_written;
+        size -= (size_t) nb_written;
+    }
+    return 0;
+}
+
+// write_output writes captured output of a command to stdout, measuring the
+// time it blocks.
+//
+// Returns 0 on success or -1 on error.
+int write_output(struct jobs *jobs, const char *buf, size_t size)
+{
+    struct timeval start, end;
+    if (monoclock(&start) == -1 || write_all(STDOUT_FILENO, buf, size) == -1 ||
+        monoclock(&end) == -1) {
+        return -1;
+    }
+    add_sample(&jobs->stats.output_us, elapsed_us(&start, &end));
+    return 0;
+}
+
+// write_vector writes data gathered from buffers to stdout, handling partial
+// writes and measuring the time it blocks. iov is modified.
+//
+// Returns 0 on success or -1 on error.
+int write_vector(struct jobs *jobs, struct iovec *iov, size_t count)
+{
+    struct timeval start, end;
+    if (monoclock(&start) == -1) {
+        return -1;
+    }
+    while (count > 0) {
+        ssize_t nb_written = writev(STDOUT_FILENO, iov, (int) count);
+        if (nb_written == -1) {
+            return -1;
+        }
+        size_t left = (size_t) nb_written;
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    if (monoclock(&end) == -1) {
+        return -1;
+    }
+    add_sample(&jobs->stats.output_us, elapsed_us(&start, &end));
+    return 0;
+}
+
+// splice_some maps data into a pipe without copying, if the platform allows.
+// The pages must be kept intact until the reader consumes them.
+//
+// Returns the number of bytes moved on success or -1 on error. errno is set to
+// ENOSYS if the platform does not support the operation.
+ssize_t splice_some(int fd, const char *buf, size_t size)
+{
+#if defined(__linux__)
+    struct iovec iov = {
+        .iov_base = (void *) buf,
+        .iov_len  = size,
+    };
+    return vmsplice(fd, &iov, 1, SPLICE_F_NONBLOCK);
+#else
+    (void) fd;
+    (void) buf;
+    (void) size;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// try_read attempts to read data from a blocking descriptor.
+//
+// deadline must be compatible with the timeval obtained via monoclock().
+//
+// Returns the number of bytes read on success, 0 on EOF, or -1 on timeout or
+// error. errno is set to EWOULDBLOCK in case of timeout, or EINTR if commands
+// have made progress (see wait_io()).
+ssize_t try_read(struct jobs *jobs, int fd, char *buf, size_t size, const struct timeval *deadline)
+{
+    int ready = wait_input(jobs, fd, deadline);
+    if (ready == -1) {
+        return -1;
+    }
+    if (ready == 0) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    return read(fd, buf, size);
+}
+
+// wait_input waits for any data available for read from given descriptor or
+// passing deadline.
+//
+// Returns 1 on receiving data, 0 on timeout, or -1 on any error. errno is set
+// to EINTR if commands have made progress (see wait_io()).
+int wait_input(struct jobs *jobs, int fd, const struct timeval *deadline)
+{
+    return wait_io(jobs, fd, deadline);
+}
+
+// wait_io waits for rfd to become readable or passing deadline. rfd may be -1
+// to ignore. See wait_fds().
+//
+// Returns 1 if rfd is ready, 0 on timeout, or -1 on any error. errno is set to
+// EINTR if commands have made progress.
+int wait_io(struct jobs *jobs, int rfd, const struct timeval *deadline)
+{
+    return wait_fds(jobs, &rfd, rfd != -1 ? 1 : 0, deadline);
+}
+
+// wait_fds waits for any of rfds to become readable or passing deadline.
+// Inputs, outputs and exits of commands are handled during the wait, and such
+// an event interrupts the wait.
+//
+// deadline must be compatible with the timeval obtained via monoclock().
+//
+// Returns 1 if any of rfds is ready, 0 on timeout, or -1 on any error. errno
+// is set to EINTR if commands have made progress.
+int wait_fds(struct jobs *jobs, const int *rfds, size_t nb_rfds, const struct timeval *deadline)
+{
+    struct loop *loop = &jobs->loop;
+    int notify_fd = sigchld_pipe[0];
+
+    if (watch_fd(loop, notify_fd, ev_read) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < nb_rfds; i++) {
+        if (watch_fd(loop, rfds[i], ev_read) == -1) {
+            return -1;
+        }
+    }
+    if (jobs->nb_compressing > 0 && watch_fd(loop, jobs->compress_notify[0], ev_read) == -1) {
+        return -1;
+    }
+
+    // Wake up for a chunk due for retry while a slot is free for it.
+    struct timeval retry_deadline;
+    int retry_wakeup = jobs->nb_waiting > 0 && jobs->running < jobs->capacity &&
+                       jobs->status == 0 && next_retry(jobs, &retry_deadline) &&
+                       (deadline == NULL || earlier(&retry_deadline, deadline));
+    if (retry_wakeup) {
+        deadline = &retry_deadline;
+    }
+
+    // Wake up for the periodic report of statistics.
+    struct stats *stats = &jobs->stats;
+    int report_wakeup = is_positive(&stats->interval) &&
+                        (deadline == NULL || earlier(&stats->next_report, deadline));
+    if (report_wakeup) {
+        deadline = &stats->next_report;
+    }
+
+    // Outputs are not read while the buffer is full. The command blocks then,
+    // until preceding commands finish and the buffer is flushed.
+    for (size_t i = 0; i < jobs->capacity; i++) {
+        struct job *job = &jobs->slots[i];
+        if (job->active && job->out_fd != -1 && job->out_size < jobs->out_cap) {
+            if (watch_fd(loop, job->out_fd, ev_read) == -1) {
+                return -1;
+            }
+        }
+        if (job->active && job->in_fd != -1 && job->input_count > 0) {
+            if (watch_fd(loop, job->in_fd, ev_write) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    struct timeval waited, woken;
+    if (monoclock(&waited) == -1 || wait_loop(loop, deadline) == -1 || monoclock(&woken) == -1) {
+        return -1;
+    }
+    add_sample(nb_rfds > 0 ? &stats->input_wait_us : &stats->job_wait_us, elapsed_us(&waited, &woken));
+
+    int progress = 0;
+
+    if (stats_requested || (is_positive(&stats->interval) && !earlier(&woken, &stats->next_report))) {
+        if (report_stats(stats, &woken) == -1) {
+            return fail(jobs, "xpipe: failed to report statistics");
+        }
+        progress = report_wakeup;
+    }
+
+    for (size_t i = 0; i < jobs->capacity; i++) {
+        struct job *job = &jobs->slots[i];
+        if (job->active && job->out_fd != -1 && (ready_events(loop, job->out_fd) & ev_read)) {
+            if (read_output(jobs, job) == -1) {
+                return fail(jobs, "xpipe: failed to write output");
+            }
+            progress = 1;
+        }
+        if (job->active && job->in_fd != -1 && (ready_events(loop, job->in_fd) & ev_write)) {
+            if (feed_job(jobs, job) == -1) {
+                return -1;
+            }
+            progress = 1;
+        }
+    }
+
+    if (ready_events(loop, notify_fd) & ev_read) {
+        char drain[64];
+        while (read(notify_fd, drain, sizeof drain) > 0) {
+            // Discard notifications; reap_jobs() finds all exited commands.
+        }
+        if (reap_jobs(jobs) == -1) {
+            return fail(jobs, "xpipe: failed to wait for command");
+        }
+        progress = 1;
+    }
+
+    if (retry_wakeup) {
+        progress = 1; // start_jobs() below sends the chunk again.
+    }
+
+    if (jobs->nb_compressing > 0 && (ready_events(loop, jobs->compress_notify[0]) & ev_read)) {
+        if (collect_chunks(jobs) == -1) {
+            return -1;
+        }
+        progress = 1;
+    }
+
+    if (progress) {
+        if (settle_jobs(jobs) == -1) {
+            return fail(jobs, "xpipe: failed to write output");
+        }
+        if (start_jobs(jobs) == -1) {
+            return -1;
+        }
+        errno = EINTR;
+        return -1;
+    }
+    for (size_t i = 0; i < nb_rfds; i++) {
+        if (ready_events(loop, rfds[i]) & ev_read) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// drain_chunks waits for all queued chunks to be written unless a command
+// fails.
+//
+// Returns 0 on success or -1 on error.
+int drain_chunks(struct jobs *jobs)
+{
+    while (jobs->chunk_count > 0 && jobs->status == 0) {
+        if (wait_grace(jobs) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// finish_jobs writes the rest of queued chunks, closes the stdin of commands
+// and waits for them to exit. Chunks are abandoned if a command has failed.
+//
+// Returns 0 on success or -1 on error.
+int finish_jobs(struct jobs *jobs)
+{
+    if (drain_chunks(jobs) == -1) {
+        return -1;
+    }
+    if (close_inputs(jobs) == -1) {
+        return fail(jobs, "xpipe: failed to close pipe");
+    }
+    return wait_jobs(jobs, 0);
+}
+
+// wait_jobs waits for running commands to finish until the number of running
+// commands becomes max_running or less.
+//
+// Returns 0 on success or -1 on error.
+int wait_jobs(struct jobs *jobs, size_t max_running)
+{
+    while (jobs->running > max_running) {
+        if (wait_grace(jobs) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// wait_grace waits for commands to make progress. Once the grace period of a
+// drain has passed, or another SIGTERM or SIGINT has arrived, the commands
+// are killed and xpipe is to exit with 128 plus the number of the signal.
+//
+// Returns 0 on success or -1 on error.
+int wait_grace(struct jobs *jobs)
+{
+    int expired = jobs->draining && drain_requested > 1;
+    if (!expired) {
+        const struct timeval *deadline = jobs->has_grace_deadline ? &jobs->grace_deadline : NULL;
+        int result = wait_io(jobs, -1, deadline);
+        if (result == -1 && errno != EINTR) {
+            return -1;
+        }
+        expired = result == 0 && deadline != NULL;
+        if (!expired) {
+            return 0;
+        }
+    }
+
+    jobs->has_grace_deadline = 0;
+    drain_requested = 1;
+    for (size_t i = 0; i < jobs->capacity; i++) {
+        const struct job *job = &jobs->slots[i];
+        if (job->active && job->pid != 0) {
+            kill(job->pid, SIGKILL);
+        }
+    }
+    if (jobs->status == 0) {
+        jobs->status = 128 + drain_signal;
+    }
+    return 0;
+}
+
+// begin_drain stops reading input on SIGTERM or SIGINT, so that the main loop
+// sends what is buffered as the last chunks, and starts the grace period.
+// Records buffered by sources are passed on as at the end of input.
+//
+// Returns 0 on success or -1 on error.
+int begin_drain(struct jobs *jobs, struct inputs *inputs)
+{
+    if (jobs->draining) {
+        return 0;
+    }
+    jobs->draining = 1;
+    for (size_t i = 0; i < inputs->count; i++) {
+        if (inputs->sources[i]->fd != -1) {
+            end_source(jobs, inputs, inputs->sources[i]);
+        }
+    }
+    if (is_positive(&jobs->grace)) {
+        if (monoclock(&jobs->grace_deadline) == -1) {
+            return fail(jobs, "xpipe: failed to read clock");
+        }
+        add(&jobs->grace_deadline, &jobs->grace, &jobs->grace_deadline);
+        jobs->has_grace_deadline = 1;
+    }
+    return 0;
+}
+
+// reap_jobs collects already exited commands without blocking.
+//
+// Returns 0 on success or -1 on error.
+int reap_jobs(struct jobs *jobs)
+{
+    for (;;) {
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid == 0) {
+            break;
+        }
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ECHILD) {
+                break;
+            }
+            return -1;
+        }
+        finish_job(jobs, pid, status);
+    }
+    return 0;
+}
+
+// read_output reads available output of a command into its buffer. The output
+// is written to stdout right away if all preceding chunks have been output.
+// With --collect, it is left for flush_outputs().
+//
+// Returns 0 on success or -1 on error.
+int read_output(struct jobs *jobs, struct job *job)
+{
+    if (job->out == NULL) {
+        job->out = get_buffer(&jobs->pool, jobs->out_cap, &job->out_capacity);
+        if (job->out == NULL) {
+            return -1;
+        }
+    }
+
+    ssize_t nb_read = read(job->out_fd, job->out + job->out_size, jobs->out_cap - job->out_size);
+    if (nb_read == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (nb_read == 0) {
+        close_job_fd(jobs, &job->out_fd);
+        return 0;
+    }
+    job->out_size += (size_t) nb_read;
+
+    if (!jobs->collect && job->seq == jobs->out_seq) {
+        if (write_output(jobs, job->out, job->out_size) == -1) {
+            return -1;
+        }
+        job->out_size = 0;
+    }
+    return 0;
+}
+
+// flush_outputs writes the complete records captured from commands with
+// --collect to stdout, gathered into as few writes as possible.
+//
+// Returns 0 on success or -1 on error.
+int flush_outputs(struct jobs *jobs)
+{
+    struct iovec iov[64];
+    struct job *sources[64];
+    size_t sizes[64];
+    size_t count = 0;
+
+    // The owner of a long record goes first, since its record may end now and
+    // let the others go.
+    struct job *owner = jobs->out_owner;
+
+    for (size_t i = 0; i <= jobs->capacity; i++) {
+        struct job *job = i == 0 ? owner : &jobs->slots[i - 1];
+        if (job != NULL && job->active && (i == 0 || job != owner)) {
+            size_t size = output_ready(jobs, job);
+            if (size > 0) {
+                iov[count].iov_base = job->out;
+                iov[count].iov_len = size;
+                sources[count] = job;
+                sizes[count] = size;
+                count++;
+            }
+        }
+        if (count == 0 || (count < sizeof iov / sizeof *iov && i < jobs->capacity)) {
+            continue;
+        }
+
+        if (write_vector(jobs, iov, count) == -1) {
+            return -1;
+        }
+        for (size_t n = 0; n < count; n++) {
+            struct job *source = sources[n];
+            struct line_scan *scan = &source->out_scan;
+            source->out_size -= sizes[n];
+            memmove(source->out, source->out + sizes[n], source->out_size);
+            scan->scanned = scan->scanned > sizes[n] ? scan->scanned - sizes[n] : 0;
+            scan->size = 0;
+            scan->count = 0;
+        }
+        count = 0;
+    }
+    return 0;
+}
+
+// output_ready finds the size of the captured output of a command that can be
+// written with --collect: the complete records, or everything once the command
+// has closed its stdout. A record longer than the buffer is written in pieces
+// as it is read, and its command owns the output until the record ends.
+//
+// Returns the number of bytes at the front of the buffer to be written.
+size_t output_ready(struct jobs *jobs, struct job *job)
+{
+    const struct record_spec *spec = jobs->record;
+    size_t keep = spec->type == record_delim ? spec->delim_size - 1 : 0;
+
+    if (jobs->out_owner == job) {
+        if (spec->type == record_u32be) {
+            size_t size = job->out_size < job->out_need ? job->out_size : job->out_need;
+            job->out_need -= size;
+            if (job->out_need == 0 || job->out_fd == -1) {
+                jobs->out_owner = NULL;
+            }
+            return size;
+        }
+        ssize_t end = end_of_record(spec, job->out, job->out_size, 0, 0);
+        if (end != -1 || job->out_fd == -1) {
+            jobs->out_owner = NULL;
+            return end != -1 ? (size_t) end : job->out_size;
+        }
+        // A delimiter may be split at the end of the buffer.
+        return job->out_size > keep ? job->out_size - keep : 0;
+    }
+    if (jobs->out_owner != NULL) {
+        return 0;
+    }
+
+    scan_lines(&job->out_scan, spec, job->out, job->out_size, 0);
+    if (job->out_fd == -1) {
+        return job->out_size;
+    }
+    if (job->out_scan.size > 0 || job->out_size < jobs->out_cap) {
+        return job->out_scan.size;
+    }
+
+    jobs->out_owner = job;
+    if (spec->type == record_u32be) {
+        // The buffer holds at least the length prefix.
+        const unsigned char *prefix = (const unsigned char *) job->out;
+        size_t length = (size_t) prefix[0] << 24 | (size_t) prefix[1] << 16 |
+                        (size_t) prefix[2] << 8 | (size_t) prefix[3];
+        job->out_need = 4 + length - job->out_size;
+        return job->out_size;
+    }
+    return job->out_size - keep;
+}
+
+// release_output returns the output buffer of a command to the pool.
+void release_output(struct jobs *jobs, struct job *job)
+{
+    if (job->out) {
+        put_buffer(&jobs->pool, job->out, job->out_capacity);
+        job->out = NULL;
+    }
+    job->out_size = 0;
+}
+
+// settle_jobs releases the slots of finished commands. In keep-order mode a
+// slot is released only after the outputs of all preceding chunks, and the
+// buffered output of the next chunk is flushed then. With --collect, a slot is
+// released once its output has been written.
+//
+// Returns 0 on success or -1 on error.
+int settle_jobs(struct jobs *jobs)
+{
+    if (jobs->collect && flush_outputs(jobs) == -1) {
+        return -1;
+    }
+
+    for (;;) {
+        struct job *next = NULL;
+
+        for (size_t i = 0; i < jobs->capacity; i++) {
+            struct job *job = &jobs->slots[i];
+            if (!job->active) {
+                continue;
+            }
+            if (job->failed && job->pid == 0) {
+                if (retry_chunk(jobs, job) == -1) {
+                    return -1;
+                }
+                continue;
+            }
+            if (jobs->keep_order && job->seq != jobs->out_seq) {
+                continue;
+            }
+            if (job->out_size > 0 && !jobs->collect) {
+                if (write_output(jobs, job->out, job->out_size) == -1) {
+                    return -1;
+                }
+                job->out_size = 0;
+            }
+            if (job->pid == 0 && job->in_fd != -1) {
+                // Command has exited without reading all of its input.
+                drop_input(jobs, job);
+                close_job_fd(jobs, &job->in_fd);
+            }
+            if (job->pid == 0 && job->out_fd == -1 && job->out_size == 0) {
+                release_output(jobs, job);
+                job->active = 0;
+                jobs->running--;
+                next = job;
+                if (jobs->retries > 0) {
+                    chunk_at(jobs, job->input_seq)->written = 1;
+                    release_chunks(jobs);
+                }
+            }
+        }
+
+        if (!jobs->keep_order || next == NULL) {
+            break;
+        }
+        jobs->out_seq++;
+    }
+    return 0;
+}
+
+// free_slot finds an unused slot in the job table.
+//
+// Returns a pointer to the slot.
+struct job *free_slot(struct jobs *jobs)
+{
+    assert(jobs->running < jobs->capacity);
+
+    for (size_t i = 0; i < jobs->capacity; i++) {
+        if (!jobs->slots[i].active) {
+            return &jobs->slots[i];
+        }
+    }
+    assert(0);
+    return NULL;
+}
+
+// add_job registers a running command process.
+void add_job(struct jobs *jobs, struct job *job, pid_t pid, int in_fd, int out_fd)
+{
+    assert(!job->active);
+
+    job->active = 1;
+    job->pid = pid;
+    job->in_fd = in_fd;
+    job->out_fd = out_fd;
+    job->out_size = 0;
+    job->out_scan = (struct line_scan) { 0, 0, 0 };
+    job->out_need = 0;
+    job->failed = 0;
+    job->input_count = 0;
+    jobs->running++;
+}
+
+// close_inputs closes the stdin of all commands to let them exit. Input not
+// written yet is abandoned.
+//
+// Returns 0 on success or -1 on error.
+int close_inputs(struct jobs *jobs)
+{
+    for (size_t i = 0; i < jobs->capacity; i++) {
+        struct job *job = &jobs->slots[i];
+        if (job->active && job->in_fd != -1) {
+            drop_input(jobs, job);
+            forget_fd(&jobs->loop, job->in_fd);
+            if (close(job->in_fd) == -1) {
+                return -1;
+            }
+            job->in_fd = -1;
+        }
+    }
+    return 0;
+}
+
+// finish_job marks an exited command process. The exit status is kept in
+// jobs->status if it is the first failure, or 128 plus the signal number if
+// the command was killed by a signal.
+void finish_job(struct jobs *jobs, pid_t pid, int status)
+{
+    struct job *job = NULL;
+    for (size_t i = 0; i < jobs->capacity; i++) {
+        if (jobs->slots[i].active && jobs->slots[i].pid == pid) {
+            job = &jobs->slots[i];
+            job->pid = 0;
+            struct timeval now;
+            if (monoclock(&now) == 0) {
+                uintmax_t run_us = elapsed_us(&job->started, &now);
+                add_sample(&jobs->stats.run_us, run_us);
+                if (jobs->adaptive.enabled && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                    adapt_chunks(&jobs->adaptive, job->size, run_us, jobs->capacity);
+                }
+            }
+            break;
+        }
+    }
+    int failed = WIFEXITED(status) ? WEXITSTATUS(status) != 0 : WIFSIGNALED(status);
+    if (failed && jobs->status == 0) {
+        if (job && jobs->retries > 0 && chunk_at(jobs, job->input_seq)->attempts < jobs->retries) {
+            job->failed = 1; // Retried by settle_jobs().
+            return;
+        }
+        jobs->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+}
+
+// fail records the description of a failed operation for report_error().
+//
+// Returns -1.
+int fail(struct jobs *jobs, const char *error)
+{
+    jobs->error = error;
+    return -1;
+}
+
+// report_error prints the description of the failed operation recorded by
+// fail() with errno, or fallback if none is recorded.
+void report_error(const struct jobs *jobs, const char *fallback)
+{
+    perror(jobs->error ? jobs->error : fallback);
+}
+
+// note_chunk counts a chunk sent for reason.
+void note_chunk(struct stats *stats, int reason, size_t size, size_t records)
+{
+    stats->flushes[reason]++;
+    add_sample(&stats->chunk_bytes, size);
+    add_sample(&stats->chunk_records, records);
+}
+
+// add_sample adds a value to a histogram.
+void add_sample(struct histogram *histogram, uintmax_t value)
+{
+    size_t i = 0;
+    while (i + 1 < sizeof histogram->buckets / sizeof histogram->buckets[0] &&
+           ((uintmax_t) 1 << i) < value) {
+        i++;
+    }
+    histogram->buckets[i]++;
+    histogram->count++;
+    histogram->sum += value;
+}
+
+// elapsed_us computes the duration between two times in microseconds.
+//
+// Returns the duration, or zero if end is not later than start.
+uintmax_t elapsed_us(const struct timeval *start, const struct timeval *end)
+{
+    if (!earlier(start, end)) {
+        return 0;
+    }
+    struct timeval diff;
+    sub(end, start, &diff);
+    return (uintmax_t) diff.tv_sec * 1000000 + (uintmax_t) diff.tv_usec;
+}
+
+// report_stats writes the statistics to stderr in a line of name=value
+// fields. Histograms are written as the number and the sum of samples
+// followed by the non-empty buckets, each named by its upper bound. If now is
+// not NULL, the next periodic report is scheduled after now.
+//
+// Returns 0 on success or -1 on error.
+int report_stats(struct stats *stats, const struct timeval *now)
+{
+    static const char *const reasons[nb_flush_reasons] = {
+        "full", "size", "count", "timeout", "delay", "idle", "mem", "spill", "eof", "hangup",
+    };
+    char line[8192];
+    size_t length = 0;
+
+    stats_requested = 0;
+    if (now && is_positive(&stats->interval)) {
+        while (!earlier(now, &stats->next_report)) {
+            add(&stats->next_report, &stats->interval, &stats->next_report);
+        }
+    }
+
+    append_format(line, &length, sizeof line, "xpipe: stats in=%ju out=%ju chunks=%ju records=%ju "
+                  "commands=%ju flush=", stats->bytes_in, stats->bytes_out,
+                  stats->chunk_bytes.count, stats->chunk_records.sum, stats->spawn_us.count);
+    for (int i = 0; i < nb_flush_reasons; i++) {
+        append_format(line, &length, sizeof line, "%s%s:%ju", i > 0 ? "," : "", reasons[i],
+                      stats->flushes[i]);
+    }
+    format_histogram(line, &length, sizeof line, "chunk_bytes", &stats->chunk_bytes);
+    format_histogram(line, &length, sizeof line, "chunk_records", &stats->chunk_records);
+    format_histogram(line, &length, sizeof line, "carry_bytes", &stats->carry_bytes);
+    format_histogram(line, &length, sizeof line, "spawn_us", &stats->spawn_us);
+    format_histogram(line, &length, sizeof line, "run_us", &stats->run_us);
+    format_histogram(line, &length, sizeof line, "input_wait_us", &stats->input_wait_us);
+    format_histogram(line, &length, sizeof line, "job_wait_us", &stats->job_wait_us);
+    format_histogram(line, &length, sizeof line, "output_us", &stats->output_us);
+    append_format(line, &length, sizeof line, "\n");
+
+    return write_all(STDERR_FILENO, line, length);
+}
+
+// format_histogram appends a histogram field to line. See report_stats().
+void format_histogram(char *line, size_t *length, size_t capacity, const char *name,
+                      const struct histogram *histogram)
+{
+    append_format(line, length, capacity, " %s=n:%ju,sum:%ju", name, histogram->count,
+                  histogram->sum);
+    for (size_t i = 0; i < sizeof histogram->buckets / sizeof histogram->buckets[0]; i++) {
+        if (histogram->buckets[i] > 0) {
+            append_format(line, length, capacity, ",le%ju:%ju", (uintmax_t) 1 << i,
+                          histogram->buckets[i]);
+        }
+    }
+}
+
+// append_format appends formatted text to line, truncating it at capacity.
+void append_format(char *line, size_t *length, size_t capacity, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(line + *length, capacity - *length, format, args);
+    va_end(args);
+    if (result > 0) {
+        *length += (size_t) result < capacity - *length ? (size_t) result : capacity - *length - 1;
+    }
+}
+
+// setup_sigchld creates the self-pipe and installs the SIGCHLD handler.
+//
+// Returns 0 on success or -1 on error.
+int setup_sigchld(void)
+{
+    if (pipe(sigchld_pipe) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (set_nonblock(sigchld_pipe[i]) == -1 || set_cloexec(sigchld_pipe[i]) == -1) {
+            return -1;
+        }
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = handle_sigchld;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGCHLD, &action, NULL);
+}
+
+// setup_sigusr1 installs the SIGUSR1 handler, which requests a report of
+// statistics.
+//
+// Returns 0 on success or -1 on error.
+int setup_sigusr1(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = handle_sigusr1;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGUSR1, &action, NULL);
+}
+
+// setup_drain installs the handlers of SIGTERM and SIGINT, which stop input
+// and drain buffered data, and of SIGHUP, which sends buffered lines at once.
+//
+// Returns 0 on success or -1 on error.
+int setup_drain(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = handle_drain;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGTERM, &action, NULL) == -1 || sigaction(SIGINT, &action, NULL) == -1) {
+        return -1;
+    }
+    action.sa_handler = handle_sighup;
+    return sigaction(SIGHUP, &action, NULL);
+}
+
+// ignore_sigpipe lets writes to a closed pipe fail with EPIPE instead of
+// killing xpipe, so that a command may exit without reading all of its input.
+//
+// Returns 0 on success or -1 on error.
+int ignore_sigpipe(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = SIG_IGN;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SIGPIPE, &action, NULL);
+}
+
+// handle_sigchld notifies the main loop of exit of a command process.
+void handle_sigchld(int sig)
+{
+    (void) sig;
+    int saved_errno = errno;
+    ssize_t nb_written = write(sigchld_pipe[1], "", 1);
+    (void) nb_written;
+    errno = saved_errno;
+}
+
+// handle_sigusr1 requests a report of statistics and wakes up the main loop
+// through the self-pipe of SIGCHLD.
+void handle_sigusr1(int sig)
+{
+    (void) sig;
+    int saved_errno = errno;
+    stats_requested = 1;
+    ssize_t nb_written = write(sigchld_pipe[1], "", 1);
+    (void) nb_written;
+    errno = saved_errno;
+}
+
+// handle_drain requests to stop reading input and to drain buffered data, or
+// to kill commands right away if requested again, and wakes up the main loop.
+void handle_drain(int sig)
+{
+    int saved_errno = errno;
+    if (drain_requested == 0) {
+        drain_signal = sig;
+    }
+    drain_requested = drain_requested < 2 ? drain_requested + 1 : 2;
+    ssize_t nb_written = write(sigchld_pipe[1], "", 1);
+    (void) nb_written;
+    errno = saved_errno;
+}
+
+// handle_sighup requests to send buffered lines at once and wakes up the main
+// loop.
+void handle_sighup(int sig)
+{
+    (void) sig;
+    int saved_errno = errno;
+    flush_requested = 1;
+    ssize_t nb_written = write(sigchld_pipe[1], "", 1);
+    (void) nb_written;
+    errno = saved_errno;
+}
+
+// close_job_fd removes a descriptor of a command from the event loop and
+// closes it.
+void close_job_fd(struct jobs *jobs, int *fd)
+{
+    forget_fd(&jobs->loop, *fd);
+    close_or_exit(*fd, 1);
+    *fd = -1;
+}
+
+// init_loop creates an event loop.
+//
+// Returns 0 on success or -1 on error.
+int init_loop(struct loop *loop)
+{
+    loop->watches = NULL;
+    loop->capacity = 0;
+    loop->events = NULL;
+
+#if defined(HAVE_EPOLL)
+    loop->fd = epoll_create1(EPOLL_CLOEXEC);
+    return loop->fd == -1 ? -1 : 0;
+#elif defined(HAVE_KQUEUE)
+    loop->fd = kqueue();
+    if (loop->fd == -1) {
+        return -1;
+    }
+    return set_cloexec(loop->fd);
+#else
+    loop->fd = -1;
+    return 0;
+#endif
+}
+
+// free_loop releases the resources of an event loop.
+void free_loop(struct loop *loop)
+{
+    if (loop->fd != -1) {
+        close(loop->fd);
+    }
+    free(loop->watches);
+    free(loop->events);
+}
+
+// grow_loop extends the descriptor table of an event loop to hold at least
+// capacity descriptors.
+//
+// Returns 0 on success or -1 on error.
+int grow_loop(struct loop *loop, size_t capacity)
+{
+#if defined(HAVE_KQUEUE)
+    const size_t events_per_fd = 2;
+#else
+    const size_t events_per_fd = 1;
+#endif
+
+    size_t new_capacity = loop->capacity > 0 ? loop->capacity : 16;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+
+    struct watch *watches = realloc(loop->watches, new_capacity * sizeof *watches);
+    if (watches == NULL) {
+        return -1;
+    }
+    memset(watches + loop->capacity, 0, (new_capacity - loop->capacity) * sizeof *watches);
+    loop->watches = watches;
+
+    void *events = realloc(loop->events, new_capacity * events_per_fd * sizeof *loop->events);
+    if (events == NULL) {
+        return -1;
+    }
+    loop->events = events;
+    loop->capacity = new_capacity;
+    return 0;
+}
+
+// watch_fd declares events to watch on a descriptor in the next wait.
+//
+// Returns 0 on success or -1 on error.
+int watch_fd(struct loop *loop, int fd, int events)
+{
+    assert(fd >= 0);
+
+    if ((size_t) fd >= loop->capacity && grow_loop(loop, (size_t) fd + 1) == -1) {
+        return -1;
+    }
+    loop->watches[fd].wanted |= (unsigned char) events;
+    return 0;
+}
+
+// forget_fd removes a descriptor from an event loop.
+void forget_fd(struct loop *loop, int fd)
+{
+    if (fd < 0 || (size_t) fd >= loop->capacity) {
+        return;
+    }
+    struct watch *watch = &loop->watches[fd];
+    if (watch->watched != 0 && !watch->always) {
+        update_fd(loop, fd, 0); // The descriptor is about to be closed anyway.
+    }
+    memset(watch, 0, sizeof *watch);
+}
+
+// update_fd changes the events registered to the kernel for a descriptor.
+//
+// Returns 0 on success or -1 on error. errno is set to EPERM if the
+// descriptor cannot be polled, e.g. it is a regular file.
+int update_fd(struct loop *loop, int fd, int events)
+{
+    const struct watch *watch = &loop->watches[fd];
+
+#if defined(HAVE_EPOLL)
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = (events & ev_read ? EPOLLIN : 0u) | (events & ev_write ? EPOLLOUT : 0u);
+    event.data.fd = fd;
+
+    int op = watch->watched == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    return epoll_ctl(loop->fd, op, fd, &event);
+#elif defined(HAVE_KQUEUE)
+    // kqueue accepts regular files but does not report EOF as readable.
+    if (watch->watched == 0) {
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            return -1;
+        }
+        if (S_ISREG(st.st_mode)) {
+            errno = EPERM;
+            return -1;
+        }
+    }
+
+    struct kevent changes[2];
+    int count = 0;
+    int added = events & ~watch->watched;
+    int removed = watch->watched & ~events;
+
+    if (added & ev_read) {
+        EV_SET(&changes[count++], (uintptr_t) fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    }
+    if (removed & ev_read) {
+        EV_SET(&changes[count++], (uintptr_t) fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    }
+    if (added & ev_write) {
+        EV_SET(&changes[count++], (uintptr_t) fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+    }
+    if (removed & ev_write) {
+        EV_SET(&changes[count++], (uintptr_t) fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    }
+    return kevent(loop->fd, changes, count, NULL, 0, NULL);
+#else
+    // poll() takes the whole interest on each call.
+    (void) loop;
+    (void) fd;
+    (void) events;
+    (void) watch;
+    return 0;
+#endif
+}
+
+// wait_loop registers the watched events declared since the last wait, and
+// waits for any of them or passing deadline. Descriptors that cannot be
+// polled are reported ready without waiting, as select() and poll() do for
+// regular files.
+//
+// deadline must be compatible with the timeval obtained via monoclock().
+//
+// Returns 0 on success or -1 on error. Ready events are given by
+// ready_events() until the next wait.
+int wait_loop(struct loop *loop, const struct timeval *deadline)
+{
+    assert(loop->capacity > 0);
+
+    int always_ready = 0;
+#if !defined(HAVE_EPOLL) && !defined(HAVE_KQUEUE)
+    nfds_t count = 0;
+#endif
+
+    for (size_t i = 0; i < loop->capacity; i++) {
+        struct watch *watch = &loop->watches[i];
+        watch->ready = 0;
+
+        if (watch->wanted != watch->watched && !watch->always) {
+            if (update_fd(loop, (int) i, watch->wanted) == -1) {
+                if (errno != EPERM) {
+                    return -1;
+                }
+                watch->always = 1;
+            }
+        }
+        watch->watched = watch->wanted;
+        watch->wanted = 0;
+
+        if (watch->always) {
+            watch->ready = watch->watched;
+            always_ready |= watch->ready != 0;
+        }
+#if !defined(HAVE_EPOLL) && !defined(HAVE_KQUEUE)
+        else if (watch->watched != 0) {
+            struct pollfd *pfd = &loop->events[count++];
+            pfd->fd = (int) i;
+            pfd->events = (short) ((watch->watched & ev_read ? POLLIN : 0) |
+                                   (watch->watched & ev_write ? POLLOUT : 0));
+            pfd->revents = 0;
+        }
+#endif
+    }
+
+    // Timeout in milliseconds, or -1 for none. Rounded up so that the wait does
+    // not end just before the deadline.
+    long timeout_ms = -1;
+    struct timeval timeout = { 0, 0 };
+    if (deadline && !always_ready) {
+        struct timeval now;
+        if (monoclock(&now) == -1) {
+            return -1;
+        }
+        sub(deadline, &now, &timeout);
+        if (timeout.tv_sec < 0) {
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 0;
+        }
+    }
+    if (deadline || always_ready) {
+        timeout_ms = timeout.tv_sec < INT_MAX / 1000 - 1
+            ? (long) timeout.tv_sec * 1000 + ((long) timeout.tv_usec + 999) / 1000
+            : INT_MAX;
+    }
+
+#if defined(HAVE_EPOLL)
+    int nb_events = epoll_wait(loop->fd, loop->events, (int) loop->capacity, (int) timeout_ms);
+    if (nb_events == -1) {
+        return -1;
+    }
+    for (int i = 0; i < nb_events; i++) {
+        const struct epoll_event *event = &loop->events[i];
+        struct watch *watch = &loop->watches[event->data.fd];
+        int ready = 0;
+        if (event->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            ready |= ev_read;
+        }
+        if (event->events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+            ready |= ev_write;
+        }
+        watch->ready |= (unsigned char) (ready & watch->watched);
+    }
+#elif defined(HAVE_KQUEUE)
+    struct timespec ts = {
+        .tv_sec  = timeout.tv_sec,
+        .tv_nsec = (long) timeout.tv_usec * 1000,
+    };
+    int nb_events = kevent(loop->fd, NULL, 0, loop->events, (int) (loop->capacity * 2),
+                           timeout_ms == -1 ? NULL : &ts);
+    if (nb_events == -1) {
+        return -1;
+    }
+    for (int i = 0; i < nb_events; i++) {
+        const struct kevent *event = &loop->events[i];
+        struct watch *watch = &loop->watches[event->ident];
+        int ready = event->filter == EVFILT_READ ? ev_read : ev_write;
+        watch->ready |= (unsigned char) (ready & watch->watched);
+    }
+#else
+    if (poll(loop->events, count, (int) timeout_ms) == -1) {
+        return -1;
+    }
+    for (nfds_t i = 0; i < count; i++) {
+        const struct pollfd *pfd = &loop->events[i];
+        struct watch *watch = &loop->watches[pfd->fd];
+        int ready = 0;
+        if (pfd->revents & (POLLIN | POLLHUP | POLLERR)) {
+            ready |= ev_read;
+        }
+        if (pfd->revents & (POLLOUT | POLLHUP | POLLERR)) {
+            ready |= ev_write;
+        }
+        watch->ready |= (unsigned char) (ready & watch->watched);
+    }
+#endif
+    return 0;
+}
+
+// ready_events gets the events of a descriptor found ready in the last wait.
+int ready_events(const struct loop *loop, int fd)
+{
+    if (fd < 0 || (size_t) fd >= loop->capacity) {
+        return 0;
+    }
+    return loop->watches[fd].ready;
+}
+
+// set_nonblock puts a descriptor into non-blocking mode.
+//
+// Returns 0 on success or -1 on error.
+int set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// set_block puts a descriptor back into blocking mode.
+//
+// Returns 0 on success or -1 on error.
+int set_block(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+// set_cloexec sets the close-on-exec flag of a descriptor.
+//
+// Returns 0 on success or -1 on error.
+int set_cloexec(int fd)
+{
+    int flags = fcntl(fd, F_GETFD);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+// close_or_exit closes fd and, on error, exits program with specified status.
+void close_or_exit(int fd, int status)
+{
+    if (close(fd) == -1) {
+        perror("xpipe: close failed");
+        exit(status);
+    }
+}
+
+// init_ring allocates a ring buffer that can hold at least capacity bytes.
+// A mirrored mapping is used where possible, and a plain heap buffer is used
+// as a fallback.
+//
+// Returns 0 on success or -1 on error.
+int init_ring(struct ring *ring, size_t capacity)
+{
+    ring->head = 0;
+    ring->size = 0;
+    ring->pinned = 0;
+
+    if (map_mirror(ring, capacity) == 0) {
+        ring->mirrored = 1;
+        return 0;
+    }
+
+    ring->base = malloc(capacity);
+    if (ring->base == NULL) {
+        return -1;
+    }
+    ring->capacity = capacity;
+    ring->mirrored = 0;
+    return 0;
+}
+
+// map_mirror maps a shared memory object twice on adjacent addresses. The
+// capacity is rounded up to a multiple of the page size.
+//
+// Returns 0 on success or -1 on error.
+int map_mirror(struct ring *ring, size_t capacity)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0) {
+        return -1;
+    }
+    size_t page = (size_t) page_size;
+    if (capacity > SIZE_MAX / 2 - page) {
+        return -1;
+    }
+    capacity = (capacity + page - 1) / page * page;
+
+    int fd = open_shared_memory();
+    if (fd == -1) {
+        return -1;
+    }
+    if (ftruncate(fd, (off_t) capacity) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // Reserve address range for two copies first, then map the object over
+    // each half.
+    char *base = mmap(NULL, 2 * capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    int flags = MAP_SHARED | MAP_FIXED;
+    if (mmap(base, capacity, PROT_READ | PROT_WRITE, flags, fd, 0) == MAP_FAILED ||
+        mmap(base + capacity, capacity, PROT_READ | PROT_WRITE, flags, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * capacity);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    advise_hugepages(base, 2 * capacity);
+
+    ring->base = base;
+    ring->capacity = capacity;
+    return 0;
+}
+
+// open_shared_memory creates an anonymous memory object for mapping.
+//
+// Returns a descriptor on success or -1 on error.
+int open_shared_memory(void)
+{
+#if defined(__linux__)
+    return memfd_create("xpipe", MFD_CLOEXEC);
+#else
+    char name[64];
+    snprintf(name, sizeof name, "/xpipe.%ld", (long) getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd != -1) {
+        shm_unlink(name);
+    }
+    return fd;
+#endif
+}
+
+// open_chunk_file creates an anonymous file to pass a chunk to a command. On
+// Linux it is a memfd that can be sealed; elsewhere an unlinked temporary file.
+//
+// Returns a file descriptor on success or -1 on error.
+int open_chunk_file(void)
+{
+#if defined(__linux__)
+    return memfd_create("xpipe-chunk", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    return open_spill();
+#endif
+}
+
+// seal_file prevents further changes to the contents and size of a file made
+// by open_chunk_file(), so that commands can map it safely. Files that cannot
+// be sealed are left as is.
+//
+// Returns 0 on success or -1 on error.
+int seal_file(int fd)
+{
+#if defined(F_ADD_SEALS)
+    return fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#else
+    (void) fd;
+    return 0;
+#endif
+}
+
+// free_ring releases the storage of a ring buffer.
+void free_ring(struct ring *ring)
+{
+    if (ring->mirrored) {
+        munmap(ring->base, 2 * ring->capacity);
+    } else {
+        free(ring->base);
+    }
+}
+
+// consume_ring discards data from the head of a ring buffer.
+void consume_ring(struct ring *ring, size_t size)
+{
+    assert(size <= ring->size);
+
+    ring->size -= size;
+    ring->head += size;
+
+    if (ring->mirrored) {
+        ring->head %= ring->capacity;
+        ring->pinned += size;
+    } else {
+        memmove(ring->base, ring->base + ring->head, ring->size);
+        ring->head = 0;
+    }
+}
+
+// discard_ring removes data from the head of a ring buffer without pinning it,
+// moving the rest of the data to head. Space pinned by earlier chunks is left
+// as is.
+void discard_ring(struct ring *ring, size_t size)
+{
+    assert(size <= ring->size);
+
+    ring->size -= size;
+    memmove(ring->base + ring->head, ring->base + ring->head + size, ring->size);
+}
+
+// release_ring frees the oldest size bytes of consumed data.
+void release_ring(struct ring *ring, size_t size)
+{
+    if (ring->mirrored) {
+        assert(size <= ring->pinned);
+        ring->pinned -= size;
+    }
+}
+
+// ring_space calculates the size of free space following the data.
+size_t ring_space(const struct ring *ring)
+{
+    return ring->capacity - ring->pinned - ring->size;
+}
+
+// prefault_ring touches every page of a ring buffer so that reading input
+// does not fault them in later.
+void prefault_ring(struct ring *ring)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t page = page_size > 0 ? (size_t) page_size : 4096;
+    size_t span = ring->mirrored ? 2 * ring->capacity : ring->capacity;
+    for (size_t offset = 0; offset < span; offset += page) {
+        ((volatile char *) ring->base)[offset] = 0;
+    }
+}
+
+// get_buffer takes a buffer of at least size bytes from a pool. The capacity
+// is rounded up to a size class.
+//
+// Returns a pointer to the buffer and assigns the capacity to *capacity on
+// success, or returns NULL on error.
+char *get_buffer(struct pool *pool, size_t size, size_t *capacity)
+{
+    size_t class = 0;
+    while (((size_t) pool_class_min << class) < size) {
+        if (((size_t) pool_class_min << class) > SIZE_MAX / 2) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        class++;
+    }
+    *capacity = (size_t) pool_class_min << class;
+    if (*capacity < pool_min) {
+        char *buf = malloc(*capacity);
+        if (buf) {
+            pool->used += *capacity;
+        }
+        return buf;
+    }
+
+    char *buf = pool->free[class];
+    if (buf) {
+        memcpy(&pool->free[class], buf, sizeof buf);
+        pool->cached -= *capacity;
+        pool->used += *capacity;
+        return buf;
+    }
+    buf = mmap(NULL, *capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        return NULL;
+    }
+    advise_hugepages(buf, *capacity);
+    pool->used += *capacity;
+    return buf;
+}
+
+// put_buffer returns a buffer taken by get_buffer() to a pool. A pooled buffer
+// is kept for reuse while the buffers taken and cached fit in the limit.
+void put_buffer(struct pool *pool, char *buf, size_t capacity)
+{
+    pool->used -= capacity;
+    if (capacity < pool_min) {
+        free(buf);
+        return;
+    }
+    if (pool->used + pool->cached + capacity > pool->limit) {
+        munmap(buf, capacity);
+        return;
+    }
+
+    size_t class = 0;
+    while (((size_t) pool_class_min << class) < capacity) {
+        class++;
+    }
+    memcpy(buf, &pool->free[class], sizeof buf);
+    pool->free[class] = buf;
+    pool->cached += capacity;
+}
+
+// trim_pool unmaps buffers cached in a pool, largest first, until the cached
+// buffers fit in limit bytes.
+void trim_pool(struct pool *pool, size_t limit)
+{
+    for (size_t class = sizeof pool->free / sizeof pool->free[0]; class-- > 0; ) {
+        while (pool->free[class] && pool->cached > limit) {
+            char *buf = pool->free[class];
+            memcpy(&pool->free[class], buf, sizeof buf);
+            munmap(buf, (size_t) pool_class_min << class);
+            pool->cached -= (size_t) pool_class_min << class;
+        }
+    }
+}
+
+// free_pool unmaps the buffers cached in a pool.
+void free_pool(struct pool *pool)
+{
+    trim_pool(pool, 0);
+}
+
+// advise_hugepages asks the kernel to back a mapping with transparent huge
+// pages if supported.
+void advise_hugepages(void *addr, size_t size)
+{
+#if defined(MADV_HUGEPAGE)
+    madvise(addr, size, MADV_HUGEPAGE);
+#else
+    (void) addr;
+    (void) size;
+#endif
+}
+
+// monoclock gets the current time point from a monotonic clock.
+//
+// Returns 0 on success or -1 on error.
+int monoclock(struct timeval *time)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+        return -1;
+    }
+    time->tv_sec = ts.tv_sec;
+    time->tv_usec = (suseconds_t) (ts.tv_nsec / 1000);
+    return 0;
+}
+
+// add calculates the time t1 + t2.
+void add(const struct timeval *t1, const struct timeval *t2, struct timeval *sum)
+{
+    sum->tv_sec = t1->tv_sec + t2->tv_sec;
+    sum->tv_usec = t1->tv_usec + t2->tv_usec;
+    normalize(sum);
+}
+
+// sub calculates the time difference t1 - t2.
+void sub(const struct timeval *t1, const struct timeval *t2, struct timeval *diff)
+{
+    diff->tv_sec = t1->tv_sec - t2->tv_sec;
+    diff->tv_usec = t1->tv_usec - t2->tv_usec;
+    normalize(diff);
+}
+
+// is_positive tests if a normalized time is greater than zero.
+int is_positive(const struct timeval *time)
+{
+    return time->tv_sec > 0 || (time->tv_sec == 0 && time->tv_usec > 0);
+}
+
+// earlier tests if normalized time t1 is before t2.
+int earlier(const struct timeval *t1, const struct timeval *t2)
+{
+    return t1->tv_sec < t2->tv_sec || (t1->tv_sec == t2->tv_sec && t1->tv_usec < t2->tv_usec);
+}
+
+// pick_deadline updates deadline to candidate if there is no deadline yet or
+// candidate is earlier.
+void pick_deadline(struct timeval *deadline, int *has_deadline, const struct timeval *candidate)
+{
+    if (!*has_deadline || earlier(candidate, deadline)) {
+        *deadline = *candidate;
+        *has_deadline = 1;
+    }
+}
+
+// record_arrival records the time when data starting at given stream offset
+// has been read.
+void record_arrival(struct arrivals *arrivals, uintmax_t offset, const struct timeval *time)
+{
+    const size_t capacity = sizeof arrivals->entries / sizeof *arrivals->entries;
+
+    if (arrivals->count == capacity) {
+        memmove(&arrivals->entries[1], &arrivals->entries[2],
+                (capacity - 2) * sizeof *arrivals->entries);
+        arrivals->count--;
+    }
+    arrivals->entries[arrivals->count].offset = offset;
+    arrivals->entries[arrivals->count].time = *time;
+    arrivals->count++;
+}
+
+// forget_arrivals discards the records of data consumed up to the stream
+// offset head. tail is the stream offset of the end of buffered data.
+void forget_arrivals(struct arrivals *arrivals, uintmax_t head, uintmax_t tail)
+{
+    if (head == tail) {
+        arrivals->count = 0;
+        return;
+    }
+
+    size_t consumed = 0;
+    while (consumed + 1 < arrivals->count && arrivals->entries[consumed + 1].offset <= head) {
+        consumed++;
+    }
+    memmove(&arrivals->entries[0], &arrivals->entries[consumed],
+            (arrivals->count - consumed) * sizeof *arrivals->entries);
+    arrivals->count -= consumed;
+}
+
+// normalize adjusts tv_usec of given time within 0 to 999999 with carries and
+// borrows from tv_sec.
+void normalize(struct timeval *time)
+{
+    const suseconds_t second_usec = 1000000;
+
+    while (time->tv_usec >= second_usec) {
+        time->tv_sec++;
+        time->tv_usec -= second_usec;
+    }
+    while (time->tv_usec < 0) {
+        time->tv_sec--;
+        time->tv_usec += second_usec;
+    }
+}
+
+// parse_size parses and validates a size_t from string and stores the result
+// to given pointer (if not NULL). The number may be followed by a binary unit
+// suffix K, M, G or T.
 //
 // Returns 0 on success or -1 on error.
-int configure(struct config *config, int argc, char **argv)
+int parse_size(const char *str, size_t *value)
 {
-    for (int ch; (ch = getopt(argc, argv, "b:t:h")) != -1; ) {
-        switch (ch) {
-          case 'b':
-            if (parse_size(optarg, &config->buf_size) == -1) {
-                fputs("xpipe: invalid buffer size\n", stderr);
-                return -1;
-            }
-            break;
-
-          case 't':
-            if (parse_duration(optarg, &config->timeout) == -1) {
-                fputs("xpipe: invalid timeout\n", stderr);
-                return -1;
-            }
-            break;
+    static const char suffixes[] = "KMGT";
 
-          case 'h':
-            usage();
-            exit(0);
+    size_t len = strlen(str);
+    uintmax_t scale = 1;
 
-          default:
-            return -1;
+    const char *suffix = len > 0 ? strchr(suffixes, str[len - 1]) : NULL;
+    if (suffix && *suffix != '\0') {
+        for (const char *pos = suffixes; pos <= suffix; pos++) {
+            scale *= 1024;
         }
+        len--;
     }
-    argc -= optind;
-    argv += optind;
-
-    static char cat[] = "cat";
-    static char *default_command[] = {
-        cat, NULL
-    };
-    config->argv = argc > 0 ? argv : default_command;
 
-    return 0;
-}
+    char digits[32];
+    if (len >= sizeof digits) {
+        return -1;
+    }
+    memcpy(digits, str, len);
+    digits[len] = '\0';
 
-// run executes the main functionality: Reads stdin by chunk and sends lines in
-// each chunk to a command via pipe.
-//
-// Returns 0 on success or -1 on error.
-int run(const struct config *config)
-{
-    char *buf = malloc(config->buf_size);
-    if (buf == NULL) {
-        perror("xpipe: failed to allocate memory");
+    uintmax_t uint;
+    if (parse_uint(digits, &uint, SIZE_MAX / scale) == -1) {
         return -1;
     }
-    int result = do_run(config, buf);
-    free(buf);
-    return result;
+    if (value) {
+        *value = (size_t) (uint * scale);
+    }
+    return 0;
 }
 
-// do_run implements run() using given preallocated buffer.
+// parse_duration parses and validates a duration from string and stores the
+// result to given pointer (if not NULL). The duration is a decimal number with
+// optional fraction and unit, one of "us", "ms", "s" (default), "m" or "h".
+// Precision is a microsecond and the duration is limited to 2^31 seconds.
 //
 // Returns 0 on success or -1 on error.
-int do_run(const struct config *config, char *buf)
+int parse_duration(const char *str, struct timeval *value)
 {
-    size_t avail = 0;
+    static const struct {
+        const char *name;
+        uintmax_t usec;
+    } units[] = {
+        { "us", 1            },
+        { "ms", 1000         },
+        { "s",  1000000      },
+        { "",   1000000      },
+        { "m",  60000000     },
+        { "h",  3600000000UL },
+    };
+    const uintmax_t limit = (uintmax_t) 0x7fffffff * 1000000;
 
-    struct timeval deadline;
-    struct timeval *active_deadline = NULL;
+    uintmax_t integer = 0;
+    uintmax_t fraction = 0;
+    uintmax_t fraction_scale = 1;
+    int digits = 0;
 
-    for (;;) {
-        ssize_t nb_read = try_read(
-            STDIN_FILENO, buf + avail, config->buf_size - avail, active_deadline);
-        if (nb_read == 0) {
-            break;
-        }
-        if (nb_read == -1) {
-            if (errno != EWOULDBLOCK) {
-                perror("xpipe: failed to read from stdin");
-                return -1;
-            }
-            nb_read = 0; // Time out.
+    const char *pos = str;
+    for (; *pos >= '0' && *pos <= '9'; pos++, digits++) {
+        if (integer > limit) {
+            return -1;
         }
-
-        // Trigger a timeout measurement on the first read to empty buffer.
-        if (config->timeout > 0 && avail == 0 && nb_read > 0) {
-            if (monoclock(&deadline) == -1) {
-                perror("xpipe: failed to read clock");
-                return -1;
+        integer = integer * 10 + (uintmax_t) (*pos - '0');
+    }
+    if (*pos == '.') {
+        for (pos++; *pos >= '0' && *pos <= '9'; pos++, digits++) {
+            if (fraction_scale < 1000000000) { // Ignore beyond nanoseconds.
+                fraction = fraction * 10 + (uintmax_t) (*pos - '0');
+                fraction_scale *= 10;
             }
-            deadline.tv_sec += config->timeout;
-            active_deadline = &deadline;
         }
+    }
+    if (digits == 0) {
+        return -1;
+    }
 
-        avail += (size_t) nb_read;
-
-        if (avail == config->buf_size || nb_read == 0) {
-            int status;
-            ssize_t nb_used = pipe_lines(config->argv, buf, avail, &status);
-            if (nb_used == -1) {
-                perror("xpipe: failed to write to pipe");
-                return -1;
-            }
-            if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-                exit(WEXITSTATUS(status));
-            }
-
-            avail -= (size_t) nb_used;
-            memmove(buf, buf + nb_used, avail);
-
-            active_deadline = NULL;
+    for (size_t i = 0; i < sizeof units / sizeof *units; i++) {
+        if (strcmp(pos, units[i].name) != 0) {
+            continue;
         }
-
-        if (avail == config->buf_size) {
-            fputs("xpipe: buffer full\n", stderr);
+        uintmax_t usec = units[i].usec;
+        if (integer > limit / usec) {
             return -1;
         }
-    }
-
-    if (avail > 0) {
-        int status;
-        if (pipe_data(config->argv, buf, avail, &status) == -1) {
-            perror("xpipe: failed to write to pipe");
+        uintmax_t total = integer * usec + fraction * usec / fraction_scale;
+        if (total > limit) {
             return -1;
         }
-        if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-            exit(WEXITSTATUS(status));
+        if (value) {
+            value->tv_sec = (time_t) (total / 1000000);
+            value->tv_usec = (suseconds_t) (total % 1000000);
         }
+        return 0;
     }
-
-    return 0;
+    return -1;
 }
 
-// pipe_lines pipes lines to a command.
+// parse_frame parses batch framing specification and stores the result to
+// config. The specification is one of "nul", "u32be" or "record:TEXT".
 //
-// The function does nothing and succeeds if the data does not contain any
-// newline character.
-//
-// Returns the number of bytes piped and assigns the exit status of the command
-// to *status on success. Returns -1 on error.
-ssize_t pipe_lines(char **argv, const char *buf, size_t size, int *status)
+// Returns 0 on success or -1 on error.
+int parse_frame(const char *str, struct config *config)
 {
-    ssize_t end_pos = find_last(buf, size, '\n');
-    if (end_pos == -1) {
+    const char record_prefix[] = "record:";
+
+    if (strcmp(str, "nul") == 0) {
+        config->frame = frame_nul;
         return 0;
     }
-    size_t use = (size_t) end_pos + 1; // Include newline.
-    if (pipe_data(argv, buf, use, status) == -1) {
-        return -1;
+    if (strcmp(str, "u32be") == 0) {
+        config->frame = frame_u32be;
+        return 0;
+    }
+    if (strncmp(str, record_prefix, sizeof record_prefix - 1) == 0) {
+        config->frame = frame_record;
+        config->frame_record = str + sizeof record_prefix - 1;
+        return 0;
     }
-    return (ssize_t) use;
+    return -1;
 }
 
-// pipe_data executes a command, writes data to its stdin and waits for exit.
+// parse_delim parses record delimiter and stores the result to record. The
+// delimiter may contain escape sequences \n, \t, \r, \0, \\ and \xHH.
 //
-// Returns the number of bytes piped and assigns the exit status of the command
-// to *status on success. Returns -1 on error.
-int pipe_data(char **argv, const char *buf, size_t size, int *status)
+// Returns 0 on success or -1 on error.
+int parse_delim(const char *str, struct record_spec *record)
 {
-    int pipe_wr;
+    char *delim = malloc(strlen(str) + 1);
+    size_t size = 0;
 
-    pid_t pid = open_pipe(argv, &pipe_wr);
-    if (pid == -1) {
+    if (delim == NULL) {
         return -1;
     }
-
-    if (write_all(pipe_wr, buf, size) == -1) {
-        close_or_exit(pipe_wr, 1);
-        // XXX: pid leaks if program recovers from this error.
+    while (*str != '\0') {
+        if (*str != '\\') {
+            delim[size++] = *str++;
+            continue;
+        }
+        str++;
+        switch (*str) {
+          case 'n':  delim[size++] = '\n'; str++; break;
+          case 't':  delim[size++] = '\t'; str++; break;
+          case 'r':  delim[size++] = '\r'; str++; break;
+          case '0':  delim[size++] = '\0'; str++; break;
+          case '\\': delim[size++] = '\\'; str++; break;
+          case 'x':
+            if (!isxdigit((unsigned char) str[1]) || !isxdigit((unsigned char) str[2])) {
+                free(delim);
+                return -1;
+            }
+            char hex[3] = { str[1], str[2], '\0' };
+            delim[size++] = (char) strtol(hex, NULL, 16);
+            str += 3;
+            break;
+          default:
+            free(delim);
+            return -1;
+        }
+    }
+    if (size == 0) {
+        free(delim);
         return -1;
     }
-    close_or_exit(pipe_wr, 1);
 
-    return waitpid(pid, status, 0);
+    free(record->delim);
+    record->type = record_delim;
+    record->delim = delim;
+    record->delim_size = size;
+    return 0;
 }
 
-// open_pipe launches a command with stdin bound to a new pipe.
+// parse_key parses key specification and stores the result to key. The
+// specification is "N" or "N:C" for the N-th field delimited by character C
+// (tab by default), or "bM-N" for bytes M to N of the line. N of the byte
+// range may be omitted for the end of the line.
 //
-// Returns the PID of the command process and assigns the write end of the pipe
-// to *fd on success. Returns -1 on error.
-pid_t open_pipe(char **argv, int *fd)
+// Returns 0 on success or -1 on error.
+int parse_key(const char *str, struct key_spec *key)
 {
-    int fds[2];
-    if (pipe(fds) == -1) {
-        return -1;
-    }
-    int pipe_rd = fds[0];
-    int pipe_wr = fds[1];
+    char number[32];
 
-    pid_t pid = fork();
-    if (pid == -1) {
-        close_or_exit(pipe_rd, 1);
-        close_or_exit(pipe_wr, 1);
-        return -1;
-    }
+    if (str[0] == 'b') {
+        const char *dash = strchr(str, '-');
+        size_t len = dash ? (size_t) (dash - str - 1) : 0;
+        if (len == 0 || len >= sizeof number) {
+            return -1;
+        }
+        memcpy(number, str + 1, len);
+        number[len] = '\0';
 
-    if (pid == 0) {
-        // Child process.
-        close_or_exit(pipe_wr, exit_panic);
-        if (dup2(pipe_rd, STDIN_FILENO) == -1) {
-            exit(exit_panic);
+        size_t first;
+        size_t last = SIZE_MAX;
+        if (parse_size(number, &first) == -1 || first == 0) {
+            return -1;
+        }
+        if (dash[1] != '\0' && (parse_size(dash + 1, &last) == -1 || last < first)) {
+            return -1;
         }
-        execvp(argv[0], argv);
-        exit(exit_panic);
+        key->type = key_bytes;
+        key->first = first;
+        key->last = last;
+        return 0;
     }
 
-    // Parent process.
-    close_or_exit(pipe_rd, 1);
-    *fd = pipe_wr;
-
-    return pid;
-}
+    const char *colon = strchr(str, ':');
+    size_t len = colon ? (size_t) (colon - str) : strlen(str);
+    if (len >= sizeof number) {
+        return -1;
+    }
+    memcpy(number, str, len);
+    number[len] = '\0';
 
-// write_all writes data to a file, handling potential partial writes.
-//
-// Returns 0 on success or -1 on error.
-int write_all(int fd, const char *buf, size_t size)
-{
-    while (size > 0) {
-        ssize_t nb_written = write(fd, buf, size);
-        if (nb_written == -1) {
-            return -1;
-        }
-        buf += nb_written;
-        size -= (size_t) nb_written;
+    size_t field;
+    if (parse_size(number, &field) == -1 || field == 0) {
+        return -1;
+    }
+    if (colon && (colon[1] == '\0' || colon[2] != '\0')) {
+        return -1;
     }
+    key->type = key_field;
+    key->first = field;
+    key->delim = colon ? colon[1] : '\t';
     return 0;
 }
 
-// try_read attempts to read data from a blocking descriptor.
-//
-// deadline must be compatible with the timeval obtained via monoclock().
+// parse_stdin parses how chunks are passed to commands, which is "pipe" or
+// "memfd".
 //
-// Returns the number of bytes read on success, 0 on EOF, or -1 on timeout or
-// error. errno is set to EWOULDBLOCK in case of timeout.
-ssize_t try_read(int fd, char *buf, size_t size, const struct timeval *deadline)
+// Returns 0 on success or -1 on error.
+int parse_stdin(const char *str, int *mode)
 {
-    int ready = wait_input(fd, deadline);
-    if (ready == -1) {
-        return -1;
+    if (strcmp(str, "pipe") == 0) {
+        *mode = stdin_pipe;
+        return 0;
     }
-    if (ready == 0) {
-        errno = EWOULDBLOCK;
-        return -1;
+    if (strcmp(str, "memfd") == 0) {
+        *mode = stdin_memfd;
+        return 0;
     }
-    return read(fd, buf, size);
+    return -1;
 }
 
-// wait_input waits for any data available for read from given descriptor or
-// passing deadline.
-//
-// deadline must be compatible with the timeval obtained via monoclock().
+// parse_backoff parses the delay before a retry, which is a duration or a
+// range "min..max" of durations.
 //
-// Returns 1 on receiving data, 0 on timeout, or -1 on any error.
-int wait_input(int fd, const struct timeval *deadline)
+// Returns 0 on success or -1 on error.
+int parse_backoff(const char *str, struct timeval *min, struct timeval *max)
 {
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-
-    struct timeval timeout;
-    struct timeval *timeout_to_use = NULL;
-    if (deadline) {
-        struct timeval now;
-        if (monoclock(&now) == -1) {
+    const char *sep = strstr(str, "..");
+    if (sep == NULL) {
+        if (parse_duration(str, min) == -1) {
             return -1;
         }
-        sub(deadline, &now, &timeout);
-        timeout_to_use = &timeout;
+        *max = *min;
+        return 0;
     }
-    return select(fd + 1, &fds, NULL, NULL, timeout_to_use);
-}
 
-// close_or_exit closes fd and, on error, exits program with specified status.
-void close_or_exit(int fd, int status)
-{
-    if (close(fd) == -1) {
-        perror("xpipe: close failed");
-        exit(status);
+    char first[64];
+    size_t len = (size_t) (sep - str);
+    if (len >= sizeof first) {
+        return -1;
     }
+    memcpy(first, str, len);
+    first[len] = '\0';
+    if (parse_duration(first, min) == -1 || parse_duration(sep + 2, max) == -1 ||
+        earlier(max, min)) {
+        return -1;
+    }
+    return 0;
 }
 
-// monoclock gets the current time point from a monotonic clock.
+// parse_size_range parses a range of sizes "min..max".
 //
 // Returns 0 on success or -1 on error.
-int monoclock(struct timeval *time)
+int parse_size_range(const char *str, size_t *min, size_t *max)
 {
-    struct timespec ts;
-    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    const char *sep = strstr(str, "..");
+    if (sep == NULL) {
+        return -1;
+    }
+
+    char first[64];
+    size_t len = (size_t) (sep - str);
+    if (len >= sizeof first) {
+        return -1;
+    }
+    memcpy(first, str, len);
+    first[len] = '\0';
+    if (parse_size(first, min) == -1 || parse_size(sep + 2, max) == -1 || *max < *min) {
         return -1;
     }
-    time->tv_sec = ts.tv_sec;
-    time->tv_usec = (suseconds_t) (ts.tv_nsec / 1000);
     return 0;
 }
 
-// sub calculates the time difference t1 - t2.
-void sub(const struct timeval *t1, const struct timeval *t2, struct timeval *diff)
+// parse_balance parses the distribution of chunks among persistent workers,
+// which is "round-robin" or "least-loaded".
+//
+// Returns 0 on success or -1 on error.
+int parse_balance(const char *str, int *balance)
 {
-    diff->tv_sec = t1->tv_sec - t2->tv_sec;
-    diff->tv_usec = t1->tv_usec - t2->tv_usec;
-    normalize(diff);
+    if (strcmp(str, "round-robin") == 0) {
+        *balance = balance_round_robin;
+        return 0;
+    }
+    if (strcmp(str, "least-loaded") == 0) {
+        *balance = balance_least_loaded;
+        return 0;
+    }
+    return -1;
 }
 
-// normalize adjusts tv_usec of given time within 0 to 999999 with carries and
-// borrows from tv_sec.
-void normalize(struct timeval *time)
+// parse_compress parses compression specification and stores the result to
+// config. The specification is "gzip", "zstd" or "lz4" optionally followed by
+// ":level". Methods not compiled in are rejected with a message.
+//
+// Returns 0 on success or -1 on error.
+int parse_compress(const char *str, struct config *config)
 {
-    const suseconds_t second_usec = 1000000;
+    static const struct {
+        const char *name;
+        int method;
+        int available;
+        int level;          // default level
+        int max_level;
+    } methods[] = {
+#if defined(HAVE_ZLIB)
+        { "gzip", compress_gzip, 1, 6, 9  },
+#else
+        { "gzip", compress_gzip, 0, 0, 0  },
+#endif
+#if defined(HAVE_ZSTD)
+        { "zstd", compress_zstd, 1, 3, 22 },
+#else
+        { "zstd", compress_zstd, 0, 0, 0  },
+#endif
+#if defined(HAVE_LZ4)
+        { "lz4",  compress_lz4,  1, 0, 12 },
+#else
+        { "lz4",  compress_lz4,  0, 0, 0  },
+#endif
+    };
 
-    while (time->tv_usec >= second_usec) {
-        time->tv_sec++;
-        time->tv_usec -= second_usec;
-    }
-    while (time->tv_usec < 0) {
-        time->tv_sec--;
-        time->tv_usec += second_usec;
+    const char *colon = strchr(str, ':');
+    size_t len = colon ? (size_t) (colon - str) : strlen(str);
+
+    for (size_t i = 0; i < sizeof methods / sizeof *methods; i++) {
+        if (strlen(methods[i].name) != len || strncmp(str, methods[i].name, len) != 0) {
+            continue;
+        }
+        if (!methods[i].available) {
+            fprintf(stderr, "xpipe: %s compression is not supported by this build\n", methods[i].name);
+            return -1;
+        }
+
+        uintmax_t level = (uintmax_t) methods[i].level;
+        if (colon && parse_uint(colon + 1, &level, (uintmax_t) methods[i].max_level) == -1) {
+            fputs("xpipe: invalid compression level\n", stderr);
+            return -1;
+        }
+        config->compress = methods[i].method;
+        config->compress_level = (int) level;
+        return 0;
     }
+
+    fputs("xpipe: invalid compression\n", stderr);
+    return -1;
 }
 
-// parse_size parses and validates a size_t from string and stores the result
-// to given pointer (if not NULL).
+#if defined(HAVE_SCHED_AFFINITY)
+// parse_cpus parses a list of CPU numbers and ranges such as "0-3,6".
 //
 // Returns 0 on success or -1 on error.
-int parse_size(const char *str, size_t *value)
+int parse_cpus(const char *str, struct placement *placement)
 {
-    uintmax_t uint;
-    if (parse_uint(str, &uint, SIZE_MAX) == -1) {
-        return -1;
-    }
-    if (value) {
-        *value = (size_t) uint;
+    CPU_ZERO(&placement->cpus);
+    for (;;) {
+        uintmax_t first, last;
+        const char *comma = strchr(str, ',');
+        size_t len = comma ? (size_t) (comma - str) : strlen(str);
+        char range[64];
+        if (len == 0 || len >= sizeof range) {
+            return -1;
+        }
+        memcpy(range, str, len);
+        range[len] = '\0';
+
+        char *dash = strchr(range, '-');
+        if (dash) {
+            *dash = '\0';
+        }
+        if (parse_uint(range, &first, CPU_SETSIZE - 1) == -1 ||
+            parse_uint(dash ? dash + 1 : range, &last, CPU_SETSIZE - 1) == -1 || last < first) {
+            return -1;
+        }
+        for (uintmax_t cpu = first; cpu <= last; cpu++) {
+            CPU_SET((size_t) cpu, &placement->cpus);
+        }
+        if (comma == NULL) {
+            break;
+        }
+        str = comma + 1;
     }
+    placement->has_cpus = 1;
     return 0;
 }
+#endif
 
-// parse_duration parses and validates a time_t from string and stores the
-// result to given pointer (if not NULL).
+#if defined(HAVE_IOPRIO)
+// parse_ionice parses the I/O scheduling class of commands, "idle" or
+// "best-effort[:level]" with level from 0 (highest) to 7.
 //
 // Returns 0 on success or -1 on error.
-int parse_duration(const char *str, time_t *value)
+int parse_ionice(const char *str, struct placement *placement)
 {
-    uintmax_t uint;
-    if (parse_uint(str, &uint, 0x7fffffff) == -1) {
+    enum { ioprio_class_be = 2, ioprio_class_idle = 3, ioprio_class_shift = 13 };
+
+    if (strcmp(str, "idle") == 0) {
+        placement->ioprio = ioprio_class_idle << ioprio_class_shift;
+        return 0;
+    }
+    const char *colon = strchr(str, ':');
+    size_t len = colon ? (size_t) (colon - str) : strlen(str);
+    if (len != strlen("best-effort") || strncmp(str, "best-effort", len) != 0) {
         return -1;
     }
-    if (value) {
-        *value = (time_t) uint;
+    uintmax_t level = 4;
+    if (colon && parse_uint(colon + 1, &level, 7) == -1) {
+        return -1;
     }
+    placement->ioprio = ioprio_class_be << ioprio_class_shift | (int) level;
     return 0;
 }
+#endif
 
 // parse_uint parses unsigned integer from string with limit validation.
 //
@@ -459,17 +6709,72 @@ int parse_uint(const char *str, uintmax_t *value, uintmax_t limit)
     return 0;
 }
 
-// find_last searches data for the last occurrence of ch.
+// find_bytes searches data for the first occurrence of pattern. The libc
+// memmem() is used if available.
+//
+// Returns a pointer to the occurrence or NULL if pattern is not found.
+const char *find_bytes(const char *buf, size_t size, const char *pattern, size_t pattern_size)
+{
+#if defined(HAVE_MEMMEM)
+    return memmem(buf, size, pattern, pattern_size);
+#else
+    while (size >= pattern_size) {
+        const char *first = memchr(buf, pattern[0], size - pattern_size + 1);
+        if (first == NULL) {
+            return NULL;
+        }
+        if (memcmp(first + 1, pattern + 1, pattern_size - 1) == 0) {
+            return first;
+        }
+        size -= (size_t) (first - buf) + 1;
+        buf = first + 1;
+    }
+    return NULL;
+#endif
+}
+
+// find_last searches data for the last occurrence of ch. The libc memrchr()
+// is used if available, which is usually vectorized with runtime dispatch.
+// Otherwise data is scanned by 16-byte blocks with SSE2 or NEON, which are
+// part of the baseline of x86-64 and AArch64.
 //
 // Returns the index of the last occurrence of ch or -1 if ch is not found.
 ssize_t find_last(const char *buf, size_t size, char ch)
 {
-    ssize_t pos = (ssize_t) size - 1;
+#if defined(HAVE_MEMRCHR)
+    const char *found = memrchr(buf, ch, size);
+    return found ? found - buf : -1;
+#else
+    size_t pos = size;
+
+# if defined(__SSE2__) && defined(__GNUC__)
+    const __m128i needle = _mm_set1_epi8(ch);
+    for (; pos >= 16; pos -= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (buf + pos - 16));
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask != 0) {
+            return (ssize_t) (pos - 16) + 31 - __builtin_clz(mask);
+        }
+    }
+# elif defined(__ARM_NEON) && defined(__GNUC__)
+    const uint8x16_t needle = vdupq_n_u8((uint8_t) ch);
+    for (; pos >= 16; pos -= 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *) (buf + pos - 16)), needle);
+        // Narrow each byte of the comparison result to four bits.
+        uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+        if (mask != 0) {
+            return (ssize_t) (pos - 16) + (63 - __builtin_clzll(mask)) / 4;
+        }
+    }
+# endif
 
-    for (; pos >= 0; pos--) {
+    while (pos > 0) {
+        pos--;
         if (buf[pos] == ch) {
-            break;
+            return (ssize_t) pos;
         }
     }
-    return pos;
+    return -1;
+#endif
 }